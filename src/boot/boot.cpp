@@ -196,23 +196,16 @@ void relocate(char** argv)
   std::ifstream file_binary{path_absolute, std::ios::in | std::ios::binary};
   ethrow_if(not file_binary.is_open(), "Could not open flatimage binary file");
   std::tie(offset_beg, offset_end) = f_write_from_header(path_dir_instance / "fim_boot" , 0);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "bash", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_busybox / "busybox", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "bwrap", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "ciopfs", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_file_dwarfs_aio, offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "fim_portal", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "fim_portal_daemon", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "fim_bwrap_apparmor", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "janitor", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "lsof", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "overlayfs", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "unionfs", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "proot", offset_end);
+  for (std::string_view binary : ns_config::BINARIES)
+  {
+    fs::path path_dir = (binary == "busybox")? path_dir_busybox : path_dir_app_bin;
+    std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir / binary, offset_end);
+  } // for
   file_binary.close();
   std::error_code ec;
   fs::create_symlink(path_file_dwarfs_aio, path_dir_app_bin / "dwarfs", ec);
   fs::create_symlink(path_file_dwarfs_aio, path_dir_app_bin / "mkdwarfs", ec);
+  fs::create_symlink(path_file_dwarfs_aio, path_dir_app_bin / "dwarfsck", ec);
   auto end = std::chrono::high_resolution_clock::now();
 
   // Create busybox symlinks, allow (symlinks exists) errors
@@ -250,8 +243,11 @@ std::unique_ptr<ns_config::FlatimageConfig> boot(int argc, char** argv)
   // Set log file
   ns_log::set_sink_file(config->path_dir_mount.string() + ".boot.log");
 
+  // Register bundled tools, they come first in PATH
+  ns_subprocess::Registry::get().add(config->path_dir_app_bin);
+
   // Start portal
-  ns_portal::Portal portal = ns_portal::Portal(config->path_dir_instance / "fim_boot");
+  ns_portal::Portal portal = ns_portal::Portal(config->path_dir_instance / "portal.sock");
 
   // Refresh desktop integration
   ns_log::exception([&]{ ns_desktop::integrate(*config); });
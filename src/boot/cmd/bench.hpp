@@ -0,0 +1,113 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : bench
+///
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+
+#include "../../cpp/lib/db.hpp"
+#include "../../cpp/lib/env.hpp"
+#include "../../cpp/lib/ipc.hpp"
+#include "../../cpp/std/enum.hpp"
+#include "../../cpp/std/exception.hpp"
+
+namespace ns_cmd::ns_bench
+{
+
+ENUM(CmdBenchOp,PORTAL);
+
+struct CmdBench
+{
+  CmdBenchOp op;
+  uint64_t count;
+};
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+// fn: percentile() {{{
+// Expects a sorted vector
+inline double percentile(std::vector<double> const& vec_sorted, double p)
+{
+  qreturn_if(vec_sorted.empty(), 0);
+  size_t index = std::min(vec_sorted.size() - 1, static_cast<size_t>(p / 100.0 * vec_sorted.size()));
+  return vec_sorted[index];
+} // fn: percentile() }}}
+
+} // namespace
+
+// fn: portal() {{{
+// Measures the round trip of a portal call that runs 'true' on the host, from the connection to
+// the reception of the exit code, then reports the counters kept by the portal daemon
+inline void portal(uint64_t count)
+{
+  using namespace std::chrono_literals;
+  fs::path path_file_socket = ns_env::get_or_throw("FIM_PORTAL_FILE");
+
+  // Wait for the daemon to listen
+  for (auto time_beg = std::chrono::steady_clock::now(); not fs::exists(path_file_socket) and std::chrono::steady_clock::now() - time_beg < 5s;)
+  {
+    std::this_thread::sleep_for(10ms);
+  } // for
+  ethrow_if(not fs::exists(path_file_socket), "Portal socket '{}' is not available"_fmt(path_file_socket));
+
+  // Standard streams of the host process
+  int fd_null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  ethrow_if(fd_null < 0, "Could not open /dev/null: {}"_fmt(strerror(errno)));
+
+  auto db = ns_db::Db("{}");
+  db("command") = std::vector<std::string>{"true"};
+  db("environment") = std::vector<std::string>{"PATH={}"_fmt(ns_env::get_or_else("PATH", "/usr/bin:/bin"))};
+  std::string request = db.dump();
+
+  std::vector<double> vec_ms;
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    auto time_beg = std::chrono::steady_clock::now();
+    auto ipc = ns_ipc::Ipc::guest(path_file_socket);
+    ebreak_if(not ipc.send(request, {fd_null, fd_null, fd_null}), "Could not send request");
+    ebreak_if(not ipc.recv(), "Could not receive pid");
+    ebreak_if(not ipc.recv(), "Could not receive exit code");
+    vec_ms.push_back(std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - time_beg).count());
+  } // for
+  close(fd_null);
+
+  // Report
+  ethrow_if(vec_ms.empty(), "No portal call completed");
+  std::ranges::sort(vec_ms);
+  println("calls: {}", vec_ms.size());
+  println("min: {:.3f}ms", vec_ms.front());
+  println("p50: {:.3f}ms", percentile(vec_ms, 50));
+  println("p90: {:.3f}ms", percentile(vec_ms, 90));
+  println("p99: {:.3f}ms", percentile(vec_ms, 99));
+  println("max: {:.3f}ms", vec_ms.back());
+
+  // Counters of the daemon since it started, they include calls made outside of the benchmark
+  auto ipc = ns_ipc::Ipc::guest(path_file_socket);
+  ereturn_if(not ipc.send(std::string{R"({"metrics":"1"})"}), "Could not request daemon metrics");
+  auto opt_msg = ipc.recv();
+  ereturn_if(not opt_msg, "Could not receive daemon metrics");
+  auto expected_metrics = ns_exception::to_expected([&]
+  {
+    auto db_metrics = ns_db::Db(std::string_view{opt_msg->data});
+    println("daemon in flight: {}", std::string(db_metrics["in_flight"]));
+    println("daemon served: {}", std::string(db_metrics["served"]));
+    println("daemon failed: {}", std::string(db_metrics["failed"]));
+    println("daemon spawn avg: {}us", std::string(db_metrics["spawn_avg_us"]));
+    println("daemon spawn max: {}us", std::string(db_metrics["spawn_max_us"]));
+  });
+  elog_if(not expected_metrics, "Could not read daemon metrics: {}"_fmt(expected_metrics.error()));
+} // fn: portal() }}}
+
+} // namespace ns_cmd::ns_bench
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
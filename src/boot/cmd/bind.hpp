@@ -94,8 +94,10 @@ inline decltype(auto) del(fs::path const& path_file_config, CmdBind const& cmd)
 // fn: list() {{{
 inline decltype(auto) list(fs::path const& path_file_config)
 {
-  // Open db
-  auto db = ns_db::Db(path_file_config, ns_db::Mode::UPDATE_OR_CREATE);
+  // Listing must not create the file or take the writer lock
+  auto db = ( fs::exists(path_file_config) )?
+      ns_db::Db(path_file_config, ns_db::Mode::READ)
+    : ns_db::Db(std::string_view{"{}"});
   // Print entries to stdout
   println(db.dump(2));
 } // fn: list() }}}
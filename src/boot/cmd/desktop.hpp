@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <filesystem>
 
 #include "../../cpp/lib/reserved/desktop.hpp"
@@ -36,21 +37,14 @@ constexpr const std::array<uint32_t, 9> arr_sizes {16,22,24,32,48,64,96,128,256}
 
 namespace fs = std::filesystem;
 
+// Layout of the icon in the reserved region, the fields are accessed in place with offsetof
 #pragma pack(push, 1)
 struct Image
 {
+  // xxx + '\0'
   char m_ext[4];
   char m_data[ns_config::SIZE_RESERVED_IMAGE - 12];
   uint64_t m_size;
-  Image() = default;
-  Image(char* ext, char* data, uint64_t size)
-    : m_size(size)
-  {
-    // xxx + '\0'
-    std::copy(ext, ext+3, m_ext);
-    m_ext[3] = '\0';
-    std::copy(data, data+size, m_data);
-  } // Image
 };
 #pragma pack(pop)
 
@@ -81,8 +75,8 @@ std::expected<std::string,std::string> read_json_from_binary(ns_config::Flatimag
     , config.offset_desktop.offset
     , config.offset_desktop.size
   );
-  qreturn_if(not expected_json, expected_json.error());
-  return std::string{expected_json->get()};
+  qreturn_if(not expected_json, std::unexpected(expected_json.error()));
+  return *expected_json;
 } // read_json_from_binary() }}}
 
 // write_json_to_binary() {{{
@@ -109,16 +103,33 @@ std::expected<std::pair<std::unique_ptr<char[]>,uint64_t>,std::string> read_imag
 } // read_image_from_binary() }}}
 
 // write_image_to_binary() {{{
+// Writes each field of the icon, only the bytes that changed reach the disk
 std::error<std::string> write_image_to_binary(ns_config::FlatimageConfig const& config
-  , char* data
+  , std::string const& ext
+  , char const* data
   , uint64_t size)
 {
-  return ns_reserved::write(config.path_file_binary
-    , config.offset_desktop_image.offset
-    , config.offset_desktop_image.size
+  uint64_t offset = config.offset_desktop_image.offset;
+  auto error = ns_reserved::write(config.path_file_binary
+    , offset + offsetof(Image, m_ext)
+    , sizeof(Image::m_ext)
+    , ext.c_str()
+    , std::min(ext.size() + 1, sizeof(Image::m_ext))
+  );
+  qreturn_if(error, error);
+  error = ns_reserved::write(config.path_file_binary
+    , offset + offsetof(Image, m_data)
+    , sizeof(Image::m_data)
     , data
     , size
   );
+  qreturn_if(error, error);
+  return ns_reserved::write(config.path_file_binary
+    , offset + offsetof(Image, m_size)
+    , sizeof(Image::m_size)
+    , reinterpret_cast<char const*>(&size)
+    , sizeof(size)
+  );
 } // write_image_to_binary() }}}
 
 // integrate_desktop_entry() {{{
@@ -298,21 +309,30 @@ inline void integrate_icons(ns_config::FlatimageConfig const& config, ns_db::ns_
     .or_else([&]{ return get_path_file_icon_svg(desktop.get_name(), template_dir_apps_scalable); });
   // If neither exist re-integrate icons
   dreturn_if(opt_test_icon and fs::exists(*opt_test_icon), "Icons are integrated, found {}"_fmt(*opt_test_icon));
-  // Read picture from flatimage binary
-  Image image;
-  auto expected_data_image = read_image_from_binary(config.path_file_binary
-    , config.offset_desktop_image.offset
-    , sizeof(image)
+  // Read the header fields of the picture from flatimage binary
+  uint64_t offset_image = config.offset_desktop_image.offset;
+  char ext[sizeof(Image::m_ext)]{};
+  uint64_t size_image = 0;
+  auto expected_ext = ns_reserved::read(config.path_file_binary, offset_image + offsetof(Image, m_ext), sizeof(ext), ext);
+  ereturn_if(not expected_ext, expected_ext.error());
+  auto expected_size = ns_reserved::read(config.path_file_binary
+    , offset_image + offsetof(Image, m_size)
+    , sizeof(size_image)
+    , reinterpret_cast<char*>(&size_image)
   );
+  ereturn_if(not expected_size, expected_size.error());
+  ereturn_if(size_image > sizeof(Image::m_data), "Invalid icon size '{}'"_fmt(size_image));
+  ext[sizeof(ext) - 1] = '\0';
+  // Read only the bytes of the picture
+  auto expected_data_image = read_image_from_binary(config.path_file_binary, offset_image + offsetof(Image, m_data), size_image);
   ereturn_if(not expected_data_image, expected_data_image.error());
-  std::memcpy(&image, expected_data_image->first.get(), sizeof(image));
   // Create temporary file to write image to
-  auto expected_path_file_icon = ns_linux::mkstemps("/tmp", "XXXXXX.{}"_fmt(image.m_ext), 4);
+  auto expected_path_file_icon = ns_linux::mkstemps("/tmp", "XXXXXX.{}"_fmt(ext), 4);
   ereturn_if(not expected_path_file_icon, expected_path_file_icon.error());
   // Write image to temporary file
   std::ofstream file_icon(*expected_path_file_icon);
   ereturn_if(not file_icon.is_open(), "Could not open temporary image file for desktop integration");
-  file_icon.write(image.m_data, image.m_size);
+  file_icon.write(expected_data_image->first.get(), size_image);
   file_icon.close();
   // Create icons
   if ( expected_path_file_icon->string().ends_with(".svg") )
@@ -470,13 +490,8 @@ inline void setup(ns_config::FlatimageConfig const& config, fs::path const& path
   ereturn_if(size_file_icon >= config.offset_desktop_image.size, "File is too large, '{}' bytes"_fmt(size_file_icon));
   auto expected_image_data = read_image_from_binary(path_file_icon, 0, size_file_icon);
   ereturn_if(not expected_image_data, "Could not read source image: {}"_fmt(expected_image_data.error()));
-  // Create image struct to deserialize into binary format
-  Image image;
-  std::memcpy(image.m_ext, str_ext.data(), 3);
-  std::memcpy(image.m_data, expected_image_data->first.get(), expected_image_data->second);
-  image.m_size = expected_image_data->second;
-  // Serialize image struct in binary format
-  auto err = write_image_to_binary(config, reinterpret_cast<char*>(&image), sizeof(image));
+  // Serialize image in binary format
+  auto err = write_image_to_binary(config, str_ext, expected_image_data->first.get(), expected_image_data->second);
   ereturn_if(err, "Could not write image data: {}"_fmt(*err));
   // Serialize json
   auto expected_str_raw_json = ns_db::ns_desktop::serialize(*expected_desktop);
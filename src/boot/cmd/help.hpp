@@ -75,7 +75,7 @@ inline std::string help_usage()
     .with_args({
       { "cmd", "Name of the command to display help details" },
     })
-    .with_note("Available commands: fim-{exec,root,perms,env,desktop,layer,bind,commit,boot}")
+    .with_note("Available commands: fim-{exec,root,perms,env,desktop,layer,bind,commit,boot,update,bench}")
     .with_example(R"(fim-help bind")")
     .get();
 }
@@ -172,16 +172,35 @@ inline std::string layer_usage()
     .with_commands({
       { "create", "Creates a novel layer from <in-dir> and save in <out-file>" },
       { "add", "Includes the novel layer <in-file> in the image in the top of the layer stack" },
+      { "list", "Lists the layers with their offset, sizes, compression ratio and optionally mount latency" },
+      { "store", "Imports the layer <in-file> in the per-user layer store and prints its digest" },
+      { "ref", "References the layer <digest> from the layer store in the image" },
     })
     .with_usage("fim-layer create <in-dir> <out-file>")
     .with_args({
       { "in-dir", "Input directory to create a novel layer from"},
       { "out-file" , "Output file name of the layer file"},
+      { "FIM_COMPRESSION_LEVEL" , "Environment variable with the compression level from 0 to 9"},
+      { "FIM_COMPRESSION_PROFILE" , "Environment variable with the profile 'fast-commit', 'balanced' or 'distribution'"},
+      { "FIM_COMPRESSION_BUDGET" , "Environment variable with a time budget in seconds to select the compression level"},
     })
     .with_usage("fim-layer add <in-file>")
     .with_args({
       { "in-file", "Path to the layer file to include in the FlatImage"},
     })
+    .with_usage("fim-layer list [--time]")
+    .with_args({
+      { "--time", "Mounts each layer to measure its mount latency"},
+    })
+    .with_usage("fim-layer store <in-file>")
+    .with_args({
+      { "in-file", "Path to the layer file to include in the layer store"},
+      { "FIM_DIGESTS_LAYER" , "Environment variable with ':' separated digests of layers to mount from the store"},
+    })
+    .with_usage("fim-layer ref <digest>")
+    .with_args({
+      { "digest", "Digest of a layer in the layer store, as printed by 'fim-layer store'"},
+    })
     .get();
 }
 
@@ -219,6 +238,41 @@ inline std::string commit_usage()
     .get();
 }
 
+inline std::string update_usage()
+{
+  return HelpEntry{"fim-update"}
+    .with_description("Update the FlatImage in place with a delta file")
+    .with_commands({
+      { "create", "Creates a delta <out-delta> to update this image to <in-image>" },
+      { "apply", "Rewrites this image with the contents described by <in-delta>" },
+    })
+    .with_usage("fim-update create <in-image> <out-delta>")
+    .with_args({
+      { "in-image", "Path to the novel version of this image"},
+      { "out-delta", "Output file name of the delta file"},
+    })
+    .with_usage("fim-update apply <in-delta>")
+    .with_args({
+      { "in-delta", "Path to a delta file created from this image"},
+    })
+    .with_note("An interrupted apply can be resumed by running it again")
+    .get();
+}
+
+inline std::string bench_usage()
+{
+  return HelpEntry{"fim-bench"}
+    .with_description("Measure the latency of FlatImage components")
+    .with_commands({
+      { "portal", "Runs <count> portal calls of 'true', reports round trip percentiles and daemon counters" },
+    })
+    .with_usage("fim-bench portal [count]")
+    .with_args({
+      { "count", "Number of portal calls, defaults to 1000"},
+    })
+    .get();
+}
+
 inline std::string notify_usage()
 {
   return HelpEntry{"fim-notify"}
@@ -6,9 +6,19 @@
 #pragma once
 
 #include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <expected>
 #include <filesystem>
+#include <thread>
 
 #include "../../cpp/lib/subprocess.hpp"
+#include "../../cpp/lib/dwarfs.hpp"
+#include "../../cpp/lib/store.hpp"
+#include "../../cpp/lib/db.hpp"
+#include "../../cpp/std/enum.hpp"
+#include "../config/config.hpp"
+#include "../filesystems.hpp"
 
 namespace
 {
@@ -20,30 +30,193 @@ namespace fs = std::filesystem;
 namespace ns_layers
 {
 
-// fn: create() {{{
-inline void create(fs::path const& path_dir_src, fs::path const& path_file_dst, uint64_t compression_level)
+ENUM(CompressionProfile, FAST_COMMIT, BALANCED, DISTRIBUTION);
+
+// struct Compression {{{
+// Parameters forwarded to mkdwarfs
+struct Compression
 {
-  // Find mkdwarfs binary
-  auto opt_path_file_mkdwarfs = ns_subprocess::search_path("mkdwarfs");
-  ethrow_if(not opt_path_file_mkdwarfs, "Could not find 'mkdwarfs' binary");
+  uint64_t level;
+  std::optional<uint64_t> opt_block_size_bits;
+  std::optional<uint64_t> opt_workers;
+  std::optional<std::string> opt_memory_limit;
+  bool is_categorize;
+
+  std::vector<std::string> to_args() const
+  {
+    std::vector<std::string> args{"-l", std::to_string(level)};
+    if ( opt_block_size_bits ) { ns_vector::push_back(args, "-S", std::to_string(*opt_block_size_bits)); }
+    if ( opt_workers ) { ns_vector::push_back(args, "-N", std::to_string(*opt_workers)); }
+    if ( opt_memory_limit ) { ns_vector::push_back(args, "-L", *opt_memory_limit); }
+    if ( is_categorize ) { args.push_back("--categorize"); }
+    return args;
+  }
+}; // struct Compression }}}
 
-  // Compression level must be at least 1 and less or equal to 10
-  compression_level = std::clamp(compression_level, uint64_t{0}, uint64_t{9});
+// fn: compression() {{{
+// Level only, keeps the mkdwarfs defaults for everything else
+inline Compression compression(uint64_t level)
+{
+  // Compression level must be at least 0 and less or equal to 9
+  return Compression{ .level = std::clamp(level, uint64_t{0}, uint64_t{9}), .is_categorize = false };
+} // fn: compression() }}}
 
-  // // Convert to non-percentual compression level
-  // compression_level = std::ceil(22 * (static_cast<double>(compression_level) / 10));
+// fn: compression() {{{
+// Profile name as in 'fast-commit', 'balanced' or 'distribution'
+inline Compression compression(std::string str_profile)
+{
+  std::ranges::replace(str_profile, '-', '_');
+  uint64_t workers = std::max(std::thread::hardware_concurrency(), 1u);
+  switch(CompressionProfile(str_profile))
+  {
+    // Small blocks compress quickly and keep memory usage low
+    case CompressionProfile::FAST_COMMIT: return Compression
+    {
+      .level = 1,
+      .opt_block_size_bits = 20,
+      .opt_workers = workers,
+      .opt_memory_limit = "1g",
+      .is_categorize = false,
+    };
+    case CompressionProfile::BALANCED: return Compression
+    {
+      .level = 7,
+      .opt_block_size_bits = 22,
+      .opt_workers = workers,
+      .opt_memory_limit = "2g",
+      .is_categorize = true,
+    };
+    // Large blocks give the compressor a wider window for release images
+    case CompressionProfile::DISTRIBUTION: return Compression
+    {
+      .level = 9,
+      .opt_block_size_bits = 24,
+      .opt_workers = workers,
+      .opt_memory_limit = "4g",
+      .is_categorize = true,
+    };
+  } // switch
+  throw std::runtime_error("Unknown compression profile '{}'"_fmt(str_profile));
+} // fn: compression() }}}
 
-  // Compress filesystem
-  ns_log::info()("Compression level: '{}'", compression_level);
-  ns_log::info()("Compress filesystem to '{}'", path_file_dst);
-  auto ret = ns_subprocess::Subprocess(*opt_path_file_mkdwarfs)
+// fn: compression() {{{
+// Profile selected in the configuration or the plain compression level
+inline Compression compression(ns_config::FlatimageConfig const& config)
+{
+  return (config.opt_layer_compression_profile)?
+      compression(*config.opt_layer_compression_profile)
+    : compression(config.layer_compression_level);
+} // fn: compression() }}}
+
+// fn: mkdwarfs() {{{
+// Returns the elapsed time of the compression
+inline std::chrono::milliseconds mkdwarfs(fs::path const& path_file_mkdwarfs
+  , fs::path const& path_dir_src
+  , fs::path const& path_file_dst
+  , Compression const& compression)
+{
+  auto time_beg = std::chrono::steady_clock::now();
+  auto ret = ns_subprocess::Subprocess(path_file_mkdwarfs)
     .with_args("-f")
     .with_args("-i", path_dir_src, "-o", path_file_dst)
-    .with_args("-l", compression_level)
+    .with_args(compression.to_args())
     .spawn()
     .wait();
   ethrow_if(not ret, "mkdwarfs process exited abnormally");
   ethrow_if(*ret != 0, "mkdwarfs process exited with error code '{}'"_fmt(*ret));
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_beg);
+} // fn: mkdwarfs() }}}
+
+// fn: fit_budget() {{{
+// Compresses a sample of the input with decreasing levels, the first level whose extrapolated
+// time fits in the budget is selected
+inline Compression fit_budget(fs::path const& path_file_mkdwarfs
+  , fs::path const& path_dir_src
+  , Compression compression
+  , std::chrono::seconds budget)
+{
+  constexpr uint64_t const size_sample_max = 64 * 1024 * 1024;
+  // Create sample directory
+  fs::path path_dir_sample = fs::temp_directory_path() / "fim-sample-{}"_fmt(getpid());
+  fs::path path_file_sample = path_dir_sample.string() + ".dwarfs";
+  lec(fs::remove_all, path_dir_sample);
+  lec(fs::create_directories, path_dir_sample);
+  // Copy files into the sample until it reaches the maximum size, the total size is always computed
+  uint64_t size_total = 0;
+  uint64_t size_sample = 0;
+  // Unreadable entries are skipped, a traversal error ends the sampling with what was gathered
+  std::error_code ec_iter;
+  fs::recursive_directory_iterator it(path_dir_src, fs::directory_options::skip_permission_denied, ec_iter);
+  for (; not ec_iter and it != fs::recursive_directory_iterator{}; it.increment(ec_iter))
+  {
+    fs::directory_entry const& entry = *it;
+    std::error_code ec;
+    if ( entry.is_symlink(ec) or not entry.is_regular_file(ec) ) { continue; }
+    uint64_t size_file = entry.file_size(ec);
+    if ( ec ) { continue; }
+    size_total += size_file;
+    if ( size_sample + size_file > size_sample_max ) { continue; }
+    fs::path path_file_dst = path_dir_sample / fs::relative(entry.path(), path_dir_src);
+    fs::create_directories(path_file_dst.parent_path(), ec);
+    if ( fs::copy_file(entry.path(), path_file_dst, ec) ) { size_sample += size_file; }
+  } // for
+  elog_if(ec_iter, "Could not traverse '{}': {}"_fmt(path_dir_src, ec_iter.message()));
+  ns_log::info()("Sampled '{}' out of '{}' bytes", size_sample, size_total);
+  // Try from the highest level down
+  if ( size_sample > 0 )
+  {
+    double scale = static_cast<double>(size_total) / size_sample;
+    uint64_t level = compression.level + 1;
+    while ( level-- > 0 )
+    {
+      Compression compression_sample = compression;
+      compression_sample.level = level;
+      auto expected_elapsed = ns_exception::to_expected([&]
+      {
+        return mkdwarfs(path_file_mkdwarfs, path_dir_sample, path_file_sample, compression_sample);
+      });
+      if ( not expected_elapsed )
+      {
+        ns_log::error()("Could not compress sample with level '{}': {}", level, expected_elapsed.error());
+        continue;
+      } // if
+      auto estimate = std::chrono::milliseconds(static_cast<uint64_t>(expected_elapsed->count() * scale));
+      ns_log::info()("Level '{}' is estimated to take '{}ms' for the whole input", level, estimate.count());
+      if ( estimate <= budget or level == 0 )
+      {
+        compression.level = level;
+        break;
+      } // if
+    } // while
+  } // if
+  // Cleanup
+  lec(fs::remove_all, path_dir_sample);
+  lec(fs::remove, path_file_sample);
+  return compression;
+} // fn: fit_budget() }}}
+
+// fn: create() {{{
+inline void create(fs::path const& path_dir_src
+  , fs::path const& path_file_dst
+  , Compression compression
+  , std::optional<std::chrono::seconds> opt_budget = std::nullopt)
+{
+  // Find mkdwarfs binary
+  auto opt_path_file_mkdwarfs = ns_subprocess::search_path("mkdwarfs");
+  ethrow_if(not opt_path_file_mkdwarfs, "Could not find 'mkdwarfs' binary");
+
+  // Select the compression level that fits in the time budget
+  if ( opt_budget )
+  {
+    ns_log::info()("Compression budget: '{}s'", opt_budget->count());
+    compression = fit_budget(*opt_path_file_mkdwarfs, path_dir_src, compression, *opt_budget);
+  } // if
+
+  // Compress filesystem
+  ns_log::info()("Compression level: '{}'", compression.level);
+  ns_log::info()("Compress filesystem to '{}'", path_file_dst);
+  auto elapsed = mkdwarfs(*opt_path_file_mkdwarfs, path_dir_src, path_file_dst, compression);
+  ns_log::info()("Compressed filesystem in '{}ms'", elapsed.count());
 } // fn: create() }}}
 
 // fn: add() {{{
@@ -67,6 +240,164 @@ inline void add(fs::path const& path_file_binary, fs::path const& path_file_laye
   ns_log::info()("Included novel layer from file '{}'", path_file_layer);
 } // fn: add() }}}
 
+// fn: store() {{{
+// Imports a layer file into the layer store and prints its digest
+inline void store(fs::path const& path_file_layer)
+{
+  auto expected_digest = ns_store::add(path_file_layer);
+  ethrow_if(not expected_digest, expected_digest.error());
+  println(*expected_digest);
+} // fn: store() }}}
+
+// fn: ref() {{{
+// References a layer of the store by digest, it is mounted on top of the layers in the image
+inline void ref(fs::path const& path_file_config_layers, std::string const& digest)
+{
+  auto expected_path_file_layer = ns_store::get(digest);
+  ethrow_if(not expected_path_file_layer, expected_path_file_layer.error());
+  ns_db::Db(path_file_config_layers, ns_db::Mode::UPDATE_OR_CREATE).set_insert(digest);
+  ns_log::info()("Referenced layer '{}'", digest);
+} // fn: ref() }}}
+
+// struct Metadata {{{
+struct Metadata
+{
+  uint64_t size_uncompressed;
+  uint64_t count_inodes;
+}; // struct Metadata }}}
+
+// fn: metadata() {{{
+// Reads the metadata of the layer with dwarfsck, which does not mount it
+inline std::expected<Metadata,std::string> metadata(ns_dwarfs::Layer const& layer)
+{
+  auto opt_path_file_dwarfsck = ns_subprocess::search_path("dwarfsck");
+  qreturn_if(not opt_path_file_dwarfsck, std::unexpected("Could not find 'dwarfsck' binary"));
+  std::string str_json;
+  auto ret = ns_subprocess::Subprocess(*opt_path_file_dwarfsck)
+    .with_piped_outputs()
+    .with_args("--json", "--image-offset={}"_fmt(layer.offset), layer.path_file)
+    .with_stdout_handle([&](std::string const& e){ str_json.append(e).append("\n"); })
+    .spawn()
+    .wait();
+  qreturn_if(not ret, std::unexpected("dwarfsck process exited abnormally"));
+  qreturn_if(*ret != 0, std::unexpected("dwarfsck process exited with error code '{}'"_fmt(*ret)));
+  // The output is only complete after the wait
+  auto json = nlohmann::json::parse(str_json, nullptr, false);
+  qreturn_if(json.is_discarded(), std::unexpected("Could not parse the output of dwarfsck"));
+  return ns_exception::to_expected([&]
+  {
+    return Metadata
+    {
+      .size_uncompressed = json.at("original_filesystem_size").get<uint64_t>(),
+      .count_inodes = json.at("inode_count").get<uint64_t>(),
+    };
+  });
+} // fn: metadata() }}}
+
+// fn: time_mount() {{{
+// Mounts the layer in a scratch directory and returns the time until the filesystem is available
+inline std::expected<std::chrono::milliseconds,std::string> time_mount(ns_config::FlatimageConfig const& config
+  , ns_dwarfs::Layer const& layer
+  , uint64_t index)
+{
+  // Create scratch mountpoint
+  fs::path path_dir_mount_index = config.path_dir_mount / "list" / std::to_string(index);
+  lec(fs::create_directories, path_dir_mount_index);
+  // Mount and time until the filesystem is available
+  auto time_beg = std::chrono::steady_clock::now();
+  auto expected_dwarfs = ns_exception::to_expected([&]
+  {
+    return std::make_unique<ns_dwarfs::Dwarfs>(layer.path_file, path_dir_mount_index, layer.offset, layer.size, getpid());
+  });
+  auto time_end = std::chrono::steady_clock::now();
+  // Un-mount before moving to the next layer
+  if ( expected_dwarfs ) { expected_dwarfs->reset(); }
+  lec(fs::remove, path_dir_mount_index);
+  qreturn_if(not expected_dwarfs, std::unexpected(expected_dwarfs.error()));
+  return std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_beg);
+} // fn: time_mount() }}}
+
+// fn: get_layers_referenced() {{{
+// Reads the referenced layers from the same file as Filesystems::mount_dwarfs, the image layers are
+// only mounted if the file was not pushed to the upper directory yet
+inline std::vector<ns_dwarfs::Layer> get_layers_referenced(ns_config::FlatimageConfig const& config
+  , std::vector<ns_dwarfs::Layer> const& vec_layers_image)
+{
+  qreturn_if(fs::exists(config.path_file_config_layers), ns_filesystems::get_layers_referenced(config.path_file_config_layers));
+  // Mount the image layers in scratch directories
+  fs::path path_dir_mount_layers = config.path_dir_mount / "list";
+  std::vector<std::unique_ptr<ns_dwarfs::Dwarfs>> vec_mounts;
+  for (uint64_t index = 0; index < vec_layers_image.size(); ++index)
+  {
+    ns_dwarfs::Layer const& layer = vec_layers_image[index];
+    fs::path path_dir_mount_index = path_dir_mount_layers / std::to_string(index);
+    lec(fs::create_directories, path_dir_mount_index);
+    auto expected_dwarfs = ns_exception::to_expected([&]
+    {
+      return std::make_unique<ns_dwarfs::Dwarfs>(layer.path_file, path_dir_mount_index, layer.offset, layer.size, getpid());
+    });
+    ebreak_if(not expected_dwarfs, "Could not mount layer '{}': {}"_fmt(index, expected_dwarfs.error()));
+    vec_mounts.push_back(std::move(*expected_dwarfs));
+  } // for
+  auto vec_layers = ns_filesystems::get_layers_referenced(
+    ns_filesystems::get_path_file_config_layers(config.path_file_config_layers, path_dir_mount_layers, vec_mounts.size())
+  );
+  // Un-mount and remove the scratch directories
+  vec_mounts.clear();
+  for (uint64_t index = 0; index < vec_layers_image.size(); ++index)
+  {
+    std::error_code ec;
+    fs::remove(path_dir_mount_layers / std::to_string(index), ec);
+  } // for
+  return vec_layers;
+} // fn: get_layers_referenced() }}}
+
+// fn: list() {{{
+// Reads the metadata of each layer without mounting it, 'is_time_mount' also mounts each layer in
+// a scratch directory to measure its mount latency
+inline void list(ns_config::FlatimageConfig const& config, bool is_time_mount)
+{
+  // Layers in the image followed by external layers
+  std::vector<ns_dwarfs::Layer> vec_layers = ns_dwarfs::get_layers(config.path_file_binary, config.offset_filesystem);
+  uint64_t count_layers_internal = vec_layers.size();
+  ns_vector::append_range(vec_layers, get_layers_referenced(config, vec_layers));
+  ns_vector::append_range(vec_layers, ns_filesystems::get_layers_external());
+
+  // Header
+  println("{:<6} {:>12} {:>14} {:>14} {:>7} {:>10} {:>10} {}"
+    , "INDEX", "OFFSET", "COMPRESSED", "UNCOMPRESSED", "RATIO", "INODES", "MOUNT(ms)", "SOURCE"
+  );
+
+  for (uint64_t index = 0; index < vec_layers.size(); ++index)
+  {
+    ns_dwarfs::Layer const& layer = vec_layers[index];
+    std::string str_source = (index < count_layers_internal)? "image" : layer.path_file.string();
+    // Query filesystem metadata
+    auto expected_metadata = metadata(layer);
+    elog_if(not expected_metadata, "Could not query layer '{}': {}"_fmt(index, expected_metadata.error()));
+    // Optionally time the mount
+    std::string str_elapsed = "-";
+    if ( is_time_mount )
+    {
+      auto expected_elapsed = time_mount(config, layer, index);
+      elog_if(not expected_elapsed, "Could not mount layer '{}': {}"_fmt(index, expected_elapsed.error()));
+      str_elapsed = (expected_elapsed)? std::to_string(expected_elapsed->count()) : "?";
+    } // if
+    println("{:<6} {:>12} {:>14} {:>14} {:>7} {:>10} {:>10} {}"
+      , index
+      , layer.offset
+      , layer.size
+      , (expected_metadata)? std::to_string(expected_metadata->size_uncompressed) : "?"
+      , (expected_metadata and layer.size > 0)?
+          "{:.2f}"_fmt(static_cast<double>(expected_metadata->size_uncompressed) / layer.size)
+        : "?"
+      , (expected_metadata)? std::to_string(expected_metadata->count_inodes) : "?"
+      , str_elapsed
+      , str_source
+    );
+  } // for
+} // fn: list() }}}
+
 } // namespace ns_layers
 
 /* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -0,0 +1,292 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : update
+///
+
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+
+#include "../../cpp/lib/elf.hpp"
+#include "../../cpp/lib/dwarfs.hpp"
+#include "../../cpp/lib/sha256.hpp"
+#include "../../cpp/std/enum.hpp"
+#include "../../cpp/macro.hpp"
+#include "../config/config.hpp"
+
+// A delta describes a novel image in terms of the current one. The ranges in 'keep' are the boot
+// prefix and the leading layers shared by both images, they are copied from the current image.
+// The ranges in 'write' are copied from the payload of the delta, usually the reserved region and
+// the layers appended after the shared ones. The result is built in a temporary file next to the
+// image and renamed over it once complete, an interrupted apply leaves the image untouched.
+//
+// Delta file layout:
+// [8 bytes magic][8 bytes header size][json header][payload of each 'write' range in order]
+
+namespace ns_cmd::ns_update
+{
+
+ENUM(CmdUpdateOp,CREATE,APPLY);
+
+struct CmdUpdate
+{
+  CmdUpdateOp op;
+  std::vector<std::string> args;
+};
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+using json_t = nlohmann::json;
+using range_t = std::pair<uint64_t,uint64_t>;
+
+constexpr char const MAGIC[8] = {'F','I','M','D','E','L','T','A'};
+
+// fn: get_offset_reserved() {{{
+// Offset to the reserved region of an image other than the running one
+inline uint64_t get_offset_reserved(fs::path const& path_file_image)
+{
+  std::ifstream file(path_file_image, std::ios::binary);
+  ethrow_if(not file.is_open(), "Could not open image '{}'"_fmt(path_file_image));
+  // Skip the main program, the size-prefixed binaries follow it
+  uint64_t offset = ns_elf::skip_elf_header(path_file_image);
+  // Skip the binaries, as extracted by relocate() in boot.cpp
+  for (uint64_t i = 0; i < ns_config::BINARIES.size(); ++i)
+  {
+    uint64_t size;
+    file.seekg(offset);
+    ethrow_if(not file.read(reinterpret_cast<char*>(&size), sizeof(size)), "Could not read binary size from '{}'"_fmt(path_file_image));
+    offset += sizeof(size) + size;
+  } // for
+  return offset;
+} // fn: get_offset_reserved() }}}
+
+// fn: is_equal_range() {{{
+inline bool is_equal_range(fs::path const& path_file_a, fs::path const& path_file_b, range_t const& range)
+{
+  std::ifstream file_a(path_file_a, std::ios::binary);
+  std::ifstream file_b(path_file_b, std::ios::binary);
+  qreturn_if(not file_a.is_open() or not file_b.is_open(), false);
+  file_a.seekg(range.first);
+  file_b.seekg(range.first);
+  char buff_a[65536];
+  char buff_b[65536];
+  for (uint64_t size = range.second; size > 0;)
+  {
+    uint64_t size_read = std::min<uint64_t>(sizeof(buff_a), size);
+    qreturn_if(not file_a.read(buff_a, size_read) or not file_b.read(buff_b, size_read), false);
+    qreturn_if(std::memcmp(buff_a, buff_b, size_read) != 0, false);
+    size -= size_read;
+  } // for
+  return true;
+} // fn: is_equal_range() }}}
+
+// fn: hash_ranges() {{{
+inline std::string hash_ranges(fs::path const& path_file, std::vector<range_t> const& ranges)
+{
+  std::ifstream file(path_file, std::ios::binary);
+  ethrow_if(not file.is_open(), "Could not open file '{}'"_fmt(path_file));
+  ns_sha256::Sha256 sha256;
+  char buff[65536];
+  for (auto const& [offset, size_range] : ranges)
+  {
+    file.seekg(offset);
+    for (uint64_t size = size_range; size > 0;)
+    {
+      uint64_t size_read = std::min<uint64_t>(sizeof(buff), size);
+      ethrow_if(not file.read(buff, size_read), "Could not read range from '{}'"_fmt(path_file));
+      sha256.update(buff, size_read);
+      size -= size_read;
+    } // for
+  } // for
+  return sha256.digest();
+} // fn: hash_ranges() }}}
+
+// fn: copy_range() {{{
+// Copies 'size' bytes from the current position of 'file_src' to 'offset' in 'fd_dst'
+inline void copy_range(std::ifstream& file_src, int fd_dst, uint64_t offset, uint64_t size)
+{
+  char buff[65536];
+  while ( size > 0 )
+  {
+    uint64_t size_read = std::min<uint64_t>(sizeof(buff), size);
+    ethrow_if(not file_src.read(buff, size_read), "Could not read source range");
+    for (uint64_t written = 0; written < size_read;)
+    {
+      ssize_t ret = ::pwrite(fd_dst, buff + written, size_read - written, offset + written);
+      ethrow_if(ret < 0, "Could not write to image: {}"_fmt(strerror(errno)));
+      written += ret;
+    } // for
+    offset += size_read;
+    size -= size_read;
+  } // while
+} // fn: copy_range() }}}
+
+} // namespace
+
+// fn: create() {{{
+// Creates a delta to go from the current image to 'path_file_image_new'
+inline void create(ns_config::FlatimageConfig const& config
+  , fs::path const& path_file_image_new
+  , fs::path const& path_file_delta)
+{
+  fs::path const& path_file_image_old = config.path_file_binary;
+  uint64_t size_result = fs::file_size(path_file_image_new);
+  std::vector<range_t> vec_keep;
+  std::vector<range_t> vec_write;
+  // The boot prefix and its layer offsets are only shared if the binaries are the same
+  uint64_t offset_reserved = get_offset_reserved(path_file_image_new);
+  if ( offset_reserved == config.offset_reserved and is_equal_range(path_file_image_old, path_file_image_new, {0, offset_reserved}) )
+  {
+    uint64_t offset_filesystem = offset_reserved + ns_config::SIZE_RESERVED_TOTAL;
+    vec_keep.push_back({0, offset_reserved});
+    vec_write.push_back({offset_reserved, ns_config::SIZE_RESERVED_TOTAL});
+    // Keep leading layers that match in offset, size and content
+    auto vec_layers_old = ns_dwarfs::get_layers(path_file_image_old, offset_filesystem);
+    auto vec_layers_new = ns_dwarfs::get_layers(path_file_image_new, offset_filesystem);
+    uint64_t offset_keep = offset_filesystem;
+    for (uint64_t i = 0; i < std::min(vec_layers_old.size(), vec_layers_new.size()); ++i)
+    {
+      ns_dwarfs::Layer const& layer_old = vec_layers_old[i];
+      ns_dwarfs::Layer const& layer_new = vec_layers_new[i];
+      qbreak_if(layer_old.offset != layer_new.offset or layer_old.size != layer_new.size);
+      qbreak_if(not is_equal_range(path_file_image_old, path_file_image_new, {layer_new.offset, layer_new.size}));
+      offset_keep = layer_new.offset + layer_new.size;
+      ns_log::info()("Keep layer '{}'", i);
+    } // for
+    // The size header of each layer is kept together with the layer
+    if ( offset_keep > offset_filesystem ) { vec_keep.push_back({offset_filesystem, offset_keep - offset_filesystem}); }
+    if ( size_result > offset_keep ) { vec_write.push_back({offset_keep, size_result - offset_keep}); }
+  } // if
+  else
+  {
+    ns_log::info()("Boot prefix differs, the delta includes the whole image");
+    vec_write.push_back({0, size_result});
+  } // else
+  // Create header
+  json_t header;
+  header["keep"] = vec_keep;
+  header["write"] = vec_write;
+  header["sha256_base"] = hash_ranges(path_file_image_old, vec_keep);
+  header["size_result"] = size_result;
+  header["sha256_result"] = hash_ranges(path_file_image_new, {{0, size_result}});
+  std::string str_header = header.dump();
+  uint64_t size_header = str_header.size();
+  // Write delta file
+  std::ofstream file_delta(path_file_delta, std::ios::binary | std::ios::trunc);
+  ethrow_if(not file_delta.is_open(), "Could not open delta file '{}'"_fmt(path_file_delta));
+  std::ifstream file_new(path_file_image_new, std::ios::binary);
+  ethrow_if(not file_new.is_open(), "Could not open image '{}'"_fmt(path_file_image_new));
+  file_delta.write(MAGIC, sizeof(MAGIC));
+  file_delta.write(reinterpret_cast<char*>(&size_header), sizeof(size_header));
+  file_delta.write(str_header.data(), str_header.size());
+  char buff[65536];
+  for (auto const& [offset, size_range] : vec_write)
+  {
+    file_new.seekg(offset);
+    for (uint64_t size = size_range; size > 0;)
+    {
+      uint64_t size_read = std::min<uint64_t>(sizeof(buff), size);
+      ethrow_if(not file_new.read(buff, size_read), "Could not read from image '{}'"_fmt(path_file_image_new));
+      ethrow_if(not file_delta.write(buff, size_read), "Could not write to delta '{}'"_fmt(path_file_delta));
+      size -= size_read;
+    } // for
+  } // for
+  ns_log::info()("Wrote delta '{}' with '{}' bytes for an image of '{}' bytes"
+    , path_file_delta
+    , static_cast<uint64_t>(file_delta.tellp())
+    , size_result
+  );
+} // fn: create() }}}
+
+// fn: apply() {{{
+// Builds the image described by the delta in a temporary file and replaces the current image with it
+inline void apply(ns_config::FlatimageConfig const& config, fs::path const& path_file_delta)
+{
+  fs::path const& path_file_image = config.path_file_binary;
+  // Read header
+  std::ifstream file_delta(path_file_delta, std::ios::binary);
+  ethrow_if(not file_delta.is_open(), "Could not open delta file '{}'"_fmt(path_file_delta));
+  char magic[sizeof(MAGIC)];
+  uint64_t size_header;
+  ethrow_if(not file_delta.read(magic, sizeof(magic)) or std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+    , "Invalid delta file '{}'"_fmt(path_file_delta)
+  );
+  ethrow_if(not file_delta.read(reinterpret_cast<char*>(&size_header), sizeof(size_header)), "Could not read delta header size");
+  ethrow_if(size_header > fs::file_size(path_file_delta) - sizeof(MAGIC) - sizeof(size_header)
+    , "Invalid delta header size '{}'"_fmt(size_header)
+  );
+  std::string str_header(size_header, '\0');
+  ethrow_if(not file_delta.read(str_header.data(), size_header), "Could not read delta header");
+  json_t header = json_t::parse(str_header, nullptr, false);
+  ethrow_if(header.is_discarded(), "Could not parse delta header");
+  auto vec_keep = header.at("keep").get<std::vector<range_t>>();
+  auto vec_write = header.at("write").get<std::vector<range_t>>();
+  auto size_result = header.at("size_result").get<uint64_t>();
+  auto sha256_result = header.at("sha256_result").get<std::string>();
+  // Check if the image is already up to date
+  if ( fs::file_size(path_file_image) == size_result and hash_ranges(path_file_image, {{0, size_result}}) == sha256_result )
+  {
+    ns_log::info()("Image is already up to date");
+    return;
+  } // if
+  // The base must match the image the delta was created from
+  ethrow_if(hash_ranges(path_file_image, vec_keep) != header.at("sha256_base").get<std::string>()
+    , "Delta was not created from this image"
+  );
+  // Build the result next to the image, so it can be renamed over it
+  fs::path path_file_tmp = "{}.{}.tmp"_fmt(path_file_image, getpid());
+  int fd = ::open(path_file_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  ethrow_if(fd < 0, "Could not create '{}': {}"_fmt(path_file_tmp, strerror(errno)));
+  auto f_write = [&]
+  {
+    std::ifstream file_image(path_file_image, std::ios::binary);
+    ethrow_if(not file_image.is_open(), "Could not open image '{}'"_fmt(path_file_image));
+    for (auto const& [offset, size] : vec_keep)
+    {
+      file_image.seekg(offset);
+      copy_range(file_image, fd, offset, size);
+    } // for
+    for (auto const& [offset, size] : vec_write)
+    {
+      copy_range(file_delta, fd, offset, size);
+    } // for
+    ethrow_if(::ftruncate(fd, size_result) < 0, "Could not truncate '{}': {}"_fmt(path_file_tmp, strerror(errno)));
+    // Keep the permissions of the image, e.g., the executable bits
+    ethrow_if(::fchmod(fd, static_cast<mode_t>(fs::status(path_file_image).permissions())) < 0
+      , "Could not set permissions of '{}': {}"_fmt(path_file_tmp, strerror(errno))
+    );
+    ethrow_if(::fsync(fd) < 0, "Could not sync '{}': {}"_fmt(path_file_tmp, strerror(errno)));
+    // Verify result before it replaces the image
+    ethrow_if(hash_ranges(path_file_tmp, {{0, size_result}}) != sha256_result, "Checksum mismatch after update");
+    std::error_code ec;
+    fs::rename(path_file_tmp, path_file_image, ec);
+    ethrow_if(ec, "Could not replace image: {}"_fmt(ec.message()));
+  };
+  auto expected_write = ns_exception::to_expected(f_write);
+  ::close(fd);
+  if ( not expected_write )
+  {
+    std::error_code ec;
+    fs::remove(path_file_tmp, ec);
+    "Update failed, the image was not modified: {}"_throw(expected_write.error());
+  } // if
+  // Flush the directory entry of the renamed image
+  if ( int fd_dir = ::open(path_file_image.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); fd_dir >= 0 )
+  {
+    elog_if(::fsync(fd_dir) < 0, "Could not sync '{}': {}"_fmt(path_file_image.parent_path(), strerror(errno)));
+    ::close(fd_dir);
+  } // if
+  ns_log::info()("Updated image '{}'", path_file_image);
+} // fn: apply() }}}
+
+} // namespace ns_cmd::ns_update
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -6,9 +6,13 @@
 #pragma once
 
 #include <unistd.h>
+#include <array>
+#include <chrono>
+#include <optional>
 #include <filesystem>
 
 #include "../../cpp/lib/env.hpp"
+#include "../../cpp/lib/reserved.hpp"
 
 #ifndef FIM_DIST
 #define FIM_DIST "TRUNK"
@@ -44,6 +48,24 @@ inline decltype(auto) impl_update_get_config_files(std::vector<fs::path> const&
 
 } // namespace
 
+// Binaries appended to the image after the boot program, in order, each prefixed by its size
+constexpr std::array<std::string_view,13> const BINARIES =
+{
+  "bash",
+  "busybox",
+  "bwrap",
+  "ciopfs",
+  "dwarfs_aio",
+  "fim_portal",
+  "fim_portal_daemon",
+  "fim_bwrap_apparmor",
+  "janitor",
+  "lsof",
+  "overlayfs",
+  "unionfs",
+  "proot",
+};
+
 constexpr int64_t const SIZE_RESERVED_TOTAL = 2097152;
 constexpr int64_t const SIZE_RESERVED_IMAGE = 1048576;
 
@@ -95,8 +117,11 @@ struct FlatimageConfig
   fs::path path_file_config_environment;
   fs::path path_file_config_bindings;
   fs::path path_file_config_casefold;
+  fs::path path_file_config_layers;
 
   uint32_t layer_compression_level;
+  std::optional<std::string> opt_layer_compression_profile;
+  std::optional<std::chrono::seconds> opt_layer_compression_budget;
 
   std::string env_path;
 }; // }}}
@@ -133,6 +158,11 @@ inline FlatimageConfig config()
   config.path_dir_global          = ns_env::get_or_throw("FIM_DIR_GLOBAL");
   config.path_file_binary         = ns_env::get_or_throw("FIM_FILE_BINARY");
   config.path_dir_binary          = config.path_file_binary.parent_path();
+  // Map the reserved region once, the reserved accessors fall back to file streams without it
+  if ( auto error = ns_reserved::Region::map(config.path_file_binary, config.offset_reserved, SIZE_RESERVED_TOTAL) )
+  {
+    ns_log::debug()("Reserved region is not mapped: {}", *error);
+  } // if
   config.path_dir_app             = ns_env::get_or_throw("FIM_DIR_APP");
   config.path_dir_app_bin         = ns_env::get_or_throw("FIM_DIR_APP_BIN");
   config.path_dir_busybox         = ns_env::get_or_throw("FIM_DIR_BUSYBOX");
@@ -183,12 +213,18 @@ inline FlatimageConfig config()
   config.layer_compression_level  = ns_exception::to_expected([]{ return std::stoi(ns_env::get_or_else("FIM_COMPRESSION_LEVEL", "7")); })
     .value_or(7);
   config.layer_compression_level = std::clamp(config.layer_compression_level, uint32_t{0}, uint32_t{10});
+  // Named compression profile, overrides the compression level
+  config.opt_layer_compression_profile = ns_env::get_optional<std::string>("FIM_COMPRESSION_PROFILE");
+  // Time budget in seconds to select the highest compression level that finishes in time
+  config.opt_layer_compression_budget = ns_env::get_optional<std::string>("FIM_COMPRESSION_BUDGET")
+    .and_then([](auto&& e){ return ns_exception::to_optional([&]{ return std::chrono::seconds(std::stoul(e)); }); });
 
   // Paths to the configuration files
   config.path_file_config_boot        = config.path_dir_config / "boot.json";
   config.path_file_config_environment = config.path_dir_config / "environment.json";
   config.path_file_config_bindings    = config.path_dir_config / "bindings.json";
   config.path_file_config_casefold    = config.path_dir_config / "casefold.json";
+  config.path_file_config_layers      = config.path_dir_config / "layers.json";
 
   // PID
   ns_env::set("FIM_PID", getpid(), ns_env::Replace::Y);
@@ -227,6 +263,7 @@ inline decltype(auto) push_config_files(fs::path const& path_dir_layers, fs::pat
   impl_update_get_config_files(vec_path_dir_layer, path_dir_upper, "fim/config/environment.json");
   impl_update_get_config_files(vec_path_dir_layer, path_dir_upper, "fim/config/bindings.json");
   impl_update_get_config_files(vec_path_dir_layer, path_dir_upper, "fim/config/casefold.json");
+  impl_update_get_config_files(vec_path_dir_layer, path_dir_upper, "fim/config/layers.json");
 } // push_config_files() }}}
 
 } // namespace ns_config
@@ -63,18 +63,14 @@ inline void add(fs::path const& path_file_config_environment, std::vector<std::s
 
 inline std::vector<std::string> get(fs::path const& path_file_config_environment)
 {
-  std::vector<std::string> environment = ns_db::Db(path_file_config_environment, ns_db::Mode::READ).as_vector();
-  // Expand variables
-  for(auto& variable : environment)
+  auto expected_environment = ns_db::get<std::vector<std::string>>(path_file_config_environment);
+  if ( not expected_environment ) { "Could not read environment: {}"_throw(expected_environment.error()); }
+  std::vector<std::string> environment = std::move(*expected_environment);
+  // Expand variables, entries that fail to expand are kept as they are
+  ns_env::Snapshot snapshot;
+  for(auto&& error : ns_env::expand_all(environment, snapshot))
   {
-    if(auto expanded = ns_env::expand(variable))
-    {
-      variable = *expanded;
-    } // if
-    else
-    {
-      ns_log::error()("Failed to expand variable: {}", expanded.error());
-    } // else
+    ns_log::error()("Failed to expand variable: {}", error);
   } // for
   return environment;
 }
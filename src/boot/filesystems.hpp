@@ -13,6 +13,9 @@
 #include "../cpp/lib/squashfs.hpp"
 #include "../cpp/lib/dwarfs.hpp"
 #include "../cpp/lib/ciopfs.hpp"
+#include "../cpp/lib/pidfd.hpp"
+#include "../cpp/lib/store.hpp"
+#include "../cpp/lib/db.hpp"
 #include "./config/config.hpp"
 
 #include "config/config.hpp"
@@ -20,6 +23,108 @@
 namespace ns_filesystems
 {
 
+// fn: get_paths_store {{{
+// Resolves layer digests to their files in the layer store
+inline std::vector<fs::path> get_paths_store(std::vector<std::string> const& vec_digest)
+{
+  std::vector<fs::path> vec_path_file_layer;
+  for (std::string const& digest : vec_digest)
+  {
+    auto expected_path_file_layer = ns_store::get(digest);
+    econtinue_if(not expected_path_file_layer, expected_path_file_layer.error());
+    vec_path_file_layer.push_back(*expected_path_file_layer);
+  } // for
+  return vec_path_file_layer;
+} // fn: get_paths_store }}}
+
+// fn: get_path_file_config_layers {{{
+// The list of referenced layers is only in the mounted layers until it is pushed to the upper
+// directory, in that case the copy of the topmost layer among the first 'count_layers' is used
+inline fs::path get_path_file_config_layers(fs::path const& path_file_config_layers
+  , fs::path const& path_dir_mount_layers
+  , uint64_t count_layers)
+{
+  fs::path path_file_layers = path_file_config_layers;
+  for (uint64_t i = count_layers; i > 0 and not fs::exists(path_file_layers); --i)
+  {
+    path_file_layers = path_dir_mount_layers / std::to_string(i-1) / "fim/config" / path_file_config_layers.filename();
+  } // for
+  return path_file_layers;
+} // fn: get_path_file_config_layers }}}
+
+// fn: get_layers_referenced {{{
+// Layers referenced by digest in the configuration file of the image, in mount order
+inline std::vector<ns_dwarfs::Layer> get_layers_referenced(fs::path const& path_file_config_layers)
+{
+  qreturn_if(not fs::exists(path_file_config_layers), {});
+  auto expected_vec_digest = ns_exception::to_expected([&]
+  {
+    return ns_db::Db(path_file_config_layers, ns_db::Mode::READ).as_vector();
+  });
+  ereturn_if(not expected_vec_digest, "Could not read referenced layers: {}"_fmt(expected_vec_digest.error()), {});
+  std::vector<ns_dwarfs::Layer> vec_layers;
+  for (fs::path const& path_file_layer : get_paths_store(*expected_vec_digest))
+  {
+    std::error_code ec;
+    uint64_t size = fs::file_size(path_file_layer, ec);
+    econtinue_if(ec, "Could not read size of layer '{}': {}"_fmt(path_file_layer, ec.message()));
+    vec_layers.push_back(ns_dwarfs::Layer{ .path_file = path_file_layer, .offset = 0, .size = size });
+  } // for
+  return vec_layers;
+} // fn: get_layers_referenced }}}
+
+// fn: get_layers_external {{{
+// Layers from the FIM_DIRS_LAYER and FIM_FILES_LAYER variables, in mount order
+inline std::vector<ns_dwarfs::Layer> get_layers_external()
+{
+  // Get layers from layer directories
+  std::vector<fs::path> vec_path_file_layer = ns_env::get_optional("FIM_DIRS_LAYER")
+    // Expand variable, allow expansion to fail to be non-fatal
+    .transform([](auto&& e){ return ns_env::expand(e).value_or(std::string{e}); })
+    // Split directories by the char ':'
+    .transform([](auto&& e){ return ns_vector::from_string(e, ':'); })
+    // Get all files from each directory into a single vector
+    .transform([](auto&& e)
+    {
+      return e
+        // Each directory expands to a file list
+        | std::views::transform([](auto&& f){ return ns_filesystem::ns_path::list_files(f); })
+        // Filter and transform into a vector of vectors
+        | std::views::filter([](auto&& f){ return f.has_value(); })
+        | std::views::transform([](auto&& f){ return f.value(); })
+        // Joins into a single vector
+        | std::views::join
+        // Collect
+        | std::ranges::to<std::vector<fs::path>>();
+    }).value_or(std::vector<fs::path>{});
+  // Get layers from file paths
+  ns_vector::append_range(vec_path_file_layer, ns_env::get_optional("FIM_FILES_LAYER")
+    // Expand variable, allow expansion to fail to be non-fatal
+    .transform([](auto&& e){ return ns_env::expand(e).value_or(std::string{e}); })
+    // Split files by the char ':'
+    .transform([](auto&& e){ return ns_vector::from_string(e, ':') | std::ranges::to<std::vector<fs::path>>(); })
+    .value_or(std::vector<fs::path>{})
+  );
+  // Get layers from the store by digest
+  ns_vector::append_range(vec_path_file_layer, ns_env::get_optional("FIM_DIGESTS_LAYER")
+    // Split digests by the char ':'
+    .transform([](auto&& e){ return get_paths_store(ns_vector::from_string(e, ':')); })
+    .value_or(std::vector<fs::path>{})
+  );
+  // Keep valid dwarfs files
+  std::vector<ns_dwarfs::Layer> vec_layers;
+  for (fs::path const& path_file_layer : vec_path_file_layer)
+  {
+    // Check if filesystem is of type 'DWARFS'
+    econtinue_if(not ns_dwarfs::is_dwarfs(path_file_layer, 0), "Invalid dwarfs filesystem appended on the image");
+    std::error_code ec;
+    uint64_t size = fs::file_size(path_file_layer, ec);
+    econtinue_if(ec, "Could not read size of layer '{}': {}"_fmt(path_file_layer, ec.message()));
+    vec_layers.push_back(ns_dwarfs::Layer{ .path_file = path_file_layer, .offset = 0, .size = size });
+  } // for
+  return vec_layers;
+} // fn: get_layers_external }}}
+
 // class Filesystems {{{
 class Filesystems
 {
@@ -31,7 +136,12 @@ class Filesystems
     std::unique_ptr<ns_overlayfs::Overlayfs> m_overlayfs;
     std::unique_ptr<ns_unionfs::UnionFs> m_unionfs;
     std::optional<pid_t> m_opt_pid_janitor;
-    uint64_t mount_dwarfs(fs::path const& path_dir_mount, fs::path const& path_file_binary, uint64_t offset);
+    std::optional<int> m_opt_pidfd_janitor;
+    uint64_t mount_dwarfs(fs::path const& path_dir_mount
+      , fs::path const& path_file_binary
+      , fs::path const& path_file_config_layers
+      , uint64_t offset
+    );
     void mount_ciopfs(fs::path const& path_dir_lower, fs::path const& path_dir_upper);
     void mount_unionfs(std::vector<fs::path> const& vec_path_dir_layer
       , fs::path const& path_dir_data
@@ -60,7 +170,11 @@ inline Filesystems::Filesystems(ns_config::FlatimageConfig const& config)
   : m_path_dir_mount(config.path_dir_mount)
 {
   // Mount compressed layers
-  uint64_t index_fs = mount_dwarfs(config.path_dir_mount_layers, config.path_file_binary, config.offset_filesystem);
+  uint64_t index_fs = mount_dwarfs(config.path_dir_mount_layers
+    , config.path_file_binary
+    , config.path_file_config_layers
+    , config.offset_filesystem
+  );
   // Push config files to upper directories if they do not exist in it
   ns_config::push_config_files(config.path_dir_mount_layers, config.path_dir_upper_overlayfs);
   // Check if should mount ciopfs
@@ -99,8 +213,16 @@ inline Filesystems::~Filesystems()
 {
   if ( m_opt_pid_janitor and *m_opt_pid_janitor > 0)
   {
-    // Stop janitor loop & wait for cleanup
-    kill(*m_opt_pid_janitor, SIGTERM);
+    // Stop janitor loop & wait for cleanup, the pidfd cannot refer to a reused pid
+    if ( m_opt_pidfd_janitor )
+    {
+      ns_pidfd::send_signal(*m_opt_pidfd_janitor, SIGTERM);
+      close(*m_opt_pidfd_janitor);
+    } // if
+    else
+    {
+      kill(*m_opt_pid_janitor, SIGTERM);
+    } // else
     // Wait for janitor to finish execution
     int status;
     waitpid(*m_opt_pid_janitor, &status, 0);
@@ -126,7 +248,13 @@ inline void Filesystems::spawn_janitor()
   ethrow_if(m_opt_pid_janitor < 0, "Failed to fork janitor");
 
   // Is parent
-  dreturn_if(m_opt_pid_janitor > 0, "Spawned janitor with PID '{}'"_fmt(*m_opt_pid_janitor));
+  if ( m_opt_pid_janitor > 0 )
+  {
+    auto expected_pidfd_janitor = ns_pidfd::open(*m_opt_pid_janitor);
+    if ( expected_pidfd_janitor ) { m_opt_pidfd_janitor = *expected_pidfd_janitor; }
+    ns_log::debug()("Spawned janitor with PID '{}'", *m_opt_pid_janitor);
+    return;
+  } // if
 
   // Redirect stdout/stderr to a log file
   fs::path path_stdout = std::string{ns_env::get_or_throw("FIM_DIR_MOUNT")} + ".janitor.stdout.log";
@@ -160,11 +288,11 @@ inline void Filesystems::spawn_janitor()
 } // fn: spawn_janitor }}}
 
 // fn: mount_dwarfs {{{
-inline uint64_t Filesystems::mount_dwarfs(fs::path const& path_dir_mount, fs::path const& path_file_binary, uint64_t offset)
+inline uint64_t Filesystems::mount_dwarfs(fs::path const& path_dir_mount
+  , fs::path const& path_file_binary
+  , fs::path const& path_file_config_layers
+  , uint64_t offset)
 {
-  // Open the main binary
-  std::ifstream file_binary(path_file_binary, std::ios::binary);
-
   // Filesystem index
   uint64_t index_fs{};
 
@@ -185,67 +313,21 @@ inline uint64_t Filesystems::mount_dwarfs(fs::path const& path_dir_mount, fs::pa
     m_vec_path_dir_mountpoints.push_back(path_dir_mount_index);
   };
 
-  // Advance offset
-  file_binary.seekg(offset);
-
-  // Mount filesystem concatenated in the image itself
-  while (true)
+  auto f_mount_layers = [&](std::vector<ns_dwarfs::Layer> const& vec_layers)
   {
-    // Read filesystem size
-    int64_t size_fs;
-    dbreak_if(not file_binary.read(reinterpret_cast<char*>(&size_fs), sizeof(size_fs)), "Stopped reading at index {}"_fmt(index_fs));
-    ns_log::debug()("Filesystem size is '{}'", size_fs);
-    // Skip size bytes
-    offset += 8;
-    // Check if filesystem is of type 'DWARFS'
-    ebreak_if(not ns_dwarfs::is_dwarfs(path_file_binary, offset), "Invalid dwarfs filesystem appended on the image");
-    // Mount filesystem
-    f_mount(path_file_binary, path_dir_mount, index_fs, offset, size_fs);
-    // Go to next filesystem if exists
-    index_fs += 1;
-    offset += size_fs;
-    file_binary.seekg(offset);
-  } // while
-  file_binary.close();
-
-  // Get layers from layer directories
-  std::vector<fs::path> vec_path_file_layer = ns_env::get_optional("FIM_DIRS_LAYER")
-    // Expand variable, allow expansion to fail to be non-fatal
-    .transform([](auto&& e){ return ns_env::expand(e).value_or(std::string{e}); })
-    // Split directories by the char ':'
-    .transform([](auto&& e){ return ns_vector::from_string(e, ':'); })
-    // Get all files from each directory into a single vector
-    .transform([](auto&& e)
+    for (ns_dwarfs::Layer const& layer : vec_layers)
     {
-      return e
-        // Each directory expands to a file list
-        | std::views::transform([](auto&& f){ return ns_filesystem::ns_path::list_files(f); })
-        // Filter and transform into a vector of vectors
-        | std::views::filter([](auto&& f){ return f.has_value(); })
-        | std::views::transform([](auto&& f){ return f.value(); })
-        // Joins into a single vector
-        | std::views::join
-        // Collect
-        | std::ranges::to<std::vector<fs::path>>();
-    }).value_or(std::vector<fs::path>{});
-  // Get layers from file paths
-  ns_vector::append_range(vec_path_file_layer, ns_env::get_optional("FIM_FILES_LAYER")
-    // Expand variable, allow expansion to fail to be non-fatal
-    .transform([](auto&& e){ return ns_env::expand(e).value_or(std::string{e}); })
-    // Split files by the char ':'
-    .transform([](auto&& e){ return ns_vector::from_string(e, ':') | std::ranges::to<std::vector<fs::path>>(); })
-    .value_or(std::vector<fs::path>{})
-  );
-  // Mount external filesystems
-  for (fs::path const& path_file_layer : vec_path_file_layer)
-  {
-    // Check if filesystem is of type 'DWARFS'
-    econtinue_if(not ns_dwarfs::is_dwarfs(path_file_layer, 0), "Invalid dwarfs filesystem appended on the image");
-    // Mount file as a filesystem
-    f_mount(path_file_layer, path_dir_mount, index_fs, 0, fs::file_size(path_file_layer));
-    // Go to next filesystem if exists
-    index_fs += 1;
-  } // for
+      f_mount(layer.path_file, path_dir_mount, index_fs, layer.offset, layer.size);
+      // Go to next filesystem if exists
+      index_fs += 1;
+    } // for
+  };
+
+  // Mount filesystems concatenated in the image itself
+  f_mount_layers(ns_dwarfs::get_layers(path_file_binary, offset));
+  // Mount layers referenced by digest, then the external ones
+  f_mount_layers(get_layers_referenced(get_path_file_config_layers(path_file_config_layers, path_dir_mount, index_fs)));
+  f_mount_layers(get_layers_external());
 
   return index_fs;
 } // fn: mount_dwarfs }}}
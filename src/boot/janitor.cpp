@@ -3,30 +3,29 @@
 // @file        : janitor
 ///
 
-#include <thread>
-#include <chrono>
 #include <filesystem>
 #include <csignal>
+#include <ctime>
+#include <poll.h>
+#include <sys/signalfd.h>
 
 #include "../cpp/lib/log.hpp"
 #include "../cpp/lib/env.hpp"
 #include "../cpp/lib/fuse.hpp"
+#include "../cpp/lib/pidfd.hpp"
 #include "../cpp/macro.hpp"
 #include "../cpp/common.hpp"
 
 namespace fs = std::filesystem;
 
-std::atomic_bool G_CONTINUE(true);
-
-void cleanup(int)
-{
-  G_CONTINUE = false;
-} // cleanup
-
 int main(int argc, char const* argv[])
 {
-  // Register signal handler
-  signal(SIGTERM, cleanup);
+  // Block SIGTERM before anything else, it is only received while waiting for the parent so a
+  // signal sent during startup stays pending instead of being lost
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  ereturn_if(sigprocmask(SIG_BLOCK, &mask, nullptr) < 0, strerror(errno), EXIT_FAILURE);
 
   // Initialize logger
   fs::path path_file_log = std::string{ns_env::get_or_throw("FIM_DIR_MOUNT")} + ".janitor.log";
@@ -42,11 +41,23 @@ int main(int argc, char const* argv[])
   ns_log::info()("Session id is '{}'", pid_session);
 
   // Wait for parent process to exit
-  while ( kill(pid_parent, 0) == 0 and G_CONTINUE )
+  if ( auto expected_pidfd_parent = ns_pidfd::open(pid_parent); expected_pidfd_parent )
+  {
+    // Sleep until the parent exits or SIGTERM arrives, a pending signal makes the signalfd readable
+    int fd_signal = signalfd(-1, &mask, SFD_CLOEXEC);
+    ereturn_if(fd_signal < 0, strerror(errno), EXIT_FAILURE);
+    pollfd fds[]{ { .fd = *expected_pidfd_parent, .events = POLLIN, .revents = 0 }, { .fd = fd_signal, .events = POLLIN, .revents = 0 } };
+    while ( poll(fds, std::size(fds), -1) < 0 and errno == EINTR ) {}
+    close(fd_signal);
+    close(*expected_pidfd_parent);
+  } // if
+  else
   {
-    using namespace std::chrono_literals;
-    std::this_thread::sleep_for(100ms);
-  } // while
+    ns_log::debug()(expected_pidfd_parent.error());
+    // Check the parent every 100ms unless SIGTERM arrives
+    timespec timeout{ .tv_sec = 0, .tv_nsec = 100'000'000 };
+    while ( kill(pid_parent, 0) == 0 and sigtimedwait(&mask, nullptr, &timeout) != SIGTERM ) {}
+  } // else
   ns_log::info()("Parent process with pid '{}' finished", pid_parent);
 
   // Cleanup mountpoints
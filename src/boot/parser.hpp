@@ -23,8 +23,11 @@
 #include "cmd/layers.hpp"
 #include "cmd/desktop.hpp"
 #include "cmd/bind.hpp"
+#include "cmd/update.hpp"
+#include "cmd/bench.hpp"
 #include "cmd/help.hpp"
 #include "filesystems.hpp"
+#include "plan.hpp"
 
 namespace ns_parser
 {
@@ -77,7 +80,7 @@ struct CmdBoot
   std::vector<std::string> args;
 };
 
-ENUM(CmdLayerOp,CREATE,ADD);
+ENUM(CmdLayerOp,CREATE,ADD,LIST,STORE,REF);
 struct CmdLayer
 {
   CmdLayerOp op;
@@ -113,6 +116,8 @@ using CmdType = std::variant<CmdRoot
   , CmdNotify
   , CmdCaseFold
   , CmdBoot
+  , ns_cmd::ns_update::CmdUpdate
+  , ns_cmd::ns_bench::CmdBench
   , CmdNone
 >;
 // }}}
@@ -211,11 +216,20 @@ inline std::expected<CmdType, std::string> parse(int argc , char** argv)
       // Get op
       cmd.op = CmdLayerOp(argv[2]);
 
-      if ( cmd.op == CmdLayerOp::ADD )
+      if ( cmd.op == CmdLayerOp::ADD or cmd.op == CmdLayerOp::STORE or cmd.op == CmdLayerOp::REF )
       {
-        f_error(argc < 4, ns_cmd::ns_help::layer_usage(), "add requires exactly one argument");
+        f_error(argc < 4, ns_cmd::ns_help::layer_usage(), "{} requires exactly one argument"_fmt(argv[2]));
         ns_vector::push_back(cmd.args, argv[3]);
       } // if
+      else if ( cmd.op == CmdLayerOp::LIST )
+      {
+        f_error(argc > 4, ns_cmd::ns_help::layer_usage(), "list takes at most one argument");
+        if ( argc == 4 )
+        {
+          f_error(std::string_view{argv[3]} != "--time", ns_cmd::ns_help::layer_usage(), "Unknown argument '{}' for list"_fmt(argv[3]));
+          ns_vector::push_back(cmd.args, argv[3]);
+        } // if
+      } // else if
       else
       {
         f_error(argc < 5, ns_cmd::ns_help::layer_usage(), "add requires exactly two arguments");
@@ -274,6 +288,37 @@ inline std::expected<CmdType, std::string> parse(int argc , char** argv)
       f_error(argc < 3, ns_cmd::ns_help::boot_usage(), "Incorrect number of arguments");
       return CmdType(CmdBoot(argv[2], (argc > 3)? VecArgs(argv+3, argv+argc) : VecArgs{}));
     },
+    // Update the image with a delta or create one
+    ns_match::equal("fim-update") >>= [&]
+    {
+      f_error(argc < 3, ns_cmd::ns_help::update_usage(), "Incorrect number of arguments");
+      ns_cmd::ns_update::CmdUpdate cmd;
+      cmd.op = ns_cmd::ns_update::CmdUpdateOp(argv[2]);
+      if ( cmd.op == ns_cmd::ns_update::CmdUpdateOp::CREATE )
+      {
+        f_error(argc != 5, ns_cmd::ns_help::update_usage(), "create requires exactly two arguments");
+        ns_vector::push_back(cmd.args, argv[3], argv[4]);
+      } // if
+      else
+      {
+        f_error(argc != 4, ns_cmd::ns_help::update_usage(), "apply requires exactly one argument");
+        ns_vector::push_back(cmd.args, argv[3]);
+      } // else
+      return CmdType(cmd);
+    },
+    // Benchmark flatimage components
+    ns_match::equal("fim-bench") >>= [&]
+    {
+      f_error(argc < 3 or argc > 4, ns_cmd::ns_help::bench_usage(), "Incorrect number of arguments");
+      f_error(argc == 4 and not std::ranges::all_of(std::string_view{argv[3]}, [](char c){ return std::isdigit(c); })
+        , ns_cmd::ns_help::bench_usage()
+        , "Invalid count"
+      );
+      return CmdType(ns_cmd::ns_bench::CmdBench{
+          .op = ns_cmd::ns_bench::CmdBenchOp(argv[2])
+        , .count = (argc == 4)? std::stoull(argv[3]) : 1000
+      });
+    },
     // Use the default startup command
     ns_match::equal("fim-help") >>= [&]
     {
@@ -289,7 +334,9 @@ inline std::expected<CmdType, std::string> parse(int argc , char** argv)
         ns_match::equal("commit")   >>= [&]{ f_error(true, ns_cmd::ns_help::commit_usage(), ""); },
         ns_match::equal("notify")   >>= [&]{ f_error(true, ns_cmd::ns_help::notify_usage(), ""); },
         ns_match::equal("casefold") >>= [&]{ f_error(true, ns_cmd::ns_help::casefold_usage(), ""); },
-        ns_match::equal("boot")     >>= [&]{ f_error(true, ns_cmd::ns_help::boot_usage(), ""); }
+        ns_match::equal("boot")     >>= [&]{ f_error(true, ns_cmd::ns_help::boot_usage(), ""); },
+        ns_match::equal("update")   >>= [&]{ f_error(true, ns_cmd::ns_help::update_usage(), ""); },
+        ns_match::equal("bench")    >>= [&]{ f_error(true, ns_cmd::ns_help::bench_usage(), ""); }
       );
       return CmdType(CmdNone{});
     }
@@ -312,39 +359,63 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
   {
     // Mount filesystems
     auto mount = ns_filesystems::Filesystems(config);
-    // Execute specified command
-    auto environment = ns_exception::or_default([&]{ return ns_config::ns_environment::get(config.path_file_config_environment); });
     // Read permissions
     auto bits_permissions = permissions.get();
     elog_if(not bits_permissions, bits_permissions.error());
-    // Check if should use bwrap native overlayfs
-    std::optional<ns_bwrap::Overlay> bwrap_overlay = ( config.overlay_type == ns_config::OverlayType::BWRAP )?
-        std::make_optional(ns_bwrap::Overlay
-        {
-            .vec_path_dir_layer = ns_config::get_mounted_layers(config.path_dir_mount_layers)
-          , .path_dir_upper = config.path_dir_upper_overlayfs
-          , .path_dir_work = config.path_dir_work_overlayfs
-        })
+    // Reuse the launch plan of a previous launch with the same inputs
+    fs::path path_file_plan = config.path_dir_host_config / "plan.json";
+    auto expected_key = (bits_permissions)?
+        ns_plan::key(config, *bits_permissions)
+      : std::unexpected(bits_permissions.error());
+    dlog_if(not expected_key, "Launch plan is not cached: {}"_fmt(expected_key.error_or("")));
+    auto expected_plan = (expected_key)?
+        ns_plan::load(path_file_plan, *expected_key, config.path_dir_instance)
+      : std::unexpected(expected_key.error());
+    dlog_if(not expected_plan, "Build launch plan: {}"_fmt(expected_plan.error_or("")));
+    // Bwrap native overlayfs keeps its work directory
+    std::optional<fs::path> opt_path_dir_work = ( config.overlay_type == ns_config::OverlayType::BWRAP )?
+        std::make_optional(config.path_dir_work_overlayfs)
       : std::nullopt;
-    // Create bwrap command
-    ns_bwrap::Bwrap bwrap = ns_bwrap::Bwrap(config.is_root
-      , bwrap_overlay
-      , config.path_dir_mount_overlayfs
-      , config.path_file_bashrc
-      , program()
-      , args()
-      , environment);
-    // Include root binding and custom user-defined bindings
-    std::ignore = bwrap
-      .with_bind_ro("/", config.path_dir_runtime_host)
-      .with_binds_from_file(config.path_file_config_bindings);
-    // Check if should enable GPU
+    // Create bwrap command, construct in place since it cannot be moved
+    ns_bwrap::Bwrap bwrap = (expected_plan)?
+        ns_bwrap::Bwrap(config.is_root
+          , opt_path_dir_work
+          , config.path_file_bashrc
+          , *expected_plan
+          , program()
+          , args())
+      : ns_bwrap::Bwrap(config.is_root
+          , opt_path_dir_work.transform([&](auto&&)
+            {
+              return ns_bwrap::Overlay
+              {
+                  .vec_path_dir_layer = ns_config::get_mounted_layers(config.path_dir_mount_layers)
+                , .path_dir_upper = config.path_dir_upper_overlayfs
+                , .path_dir_work = config.path_dir_work_overlayfs
+              };
+            })
+          , config.path_dir_mount_overlayfs
+          , config.path_file_bashrc
+          , program()
+          , args()
+          , ns_exception::or_default([&]{ return ns_config::ns_environment::get(config.path_file_config_environment); }));
+    if ( not expected_plan )
+    {
+      // Include root binding, custom user-defined bindings and permissions
+      std::ignore = bwrap
+        .with_bind_ro("/", config.path_dir_runtime_host)
+        .with_binds_from_file(config.path_file_config_bindings)
+        .with_permissions(*bits_permissions);
+      // Save plan for the next launches
+      if ( expected_key ) { ns_plan::save(path_file_plan, *expected_key, config.path_dir_instance, bwrap.plan()); }
+    } // if
+    // Check if should enable GPU, the links are kept in a manifest of their own
     if ( bits_permissions->gpu )
     {
       std::ignore = bwrap.with_bind_gpu(config.path_dir_upper_overlayfs, config.path_dir_runtime_host);
     }
     // Run bwrap
-    return bwrap.run(*bits_permissions);
+    return bwrap.run();
   };
 
   auto f_bwrap = [&]<typename T, typename U>(T&& program, U&& args)
@@ -435,9 +506,25 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
     {
       ns_layers::add(config.path_file_binary, cmd->args.front());
     } // if
+    else if ( cmd->op == CmdLayerOp::LIST )
+    {
+      ns_layers::list(config, not cmd->args.empty());
+    } // else if
+    else if ( cmd->op == CmdLayerOp::STORE )
+    {
+      ns_layers::store(cmd->args.front());
+    } // else if
+    else if ( cmd->op == CmdLayerOp::REF )
+    {
+      ns_layers::ref(config.path_file_config_layers, cmd->args.front());
+    } // else if
     else
     {
-      ns_layers::create(cmd->args.at(0), cmd->args.at(1), config.layer_compression_level);
+      ns_layers::create(cmd->args.at(0)
+        , cmd->args.at(1)
+        , ns_layers::compression(config)
+        , config.opt_layer_compression_budget
+      );
     } // else
   } // else if
   // Bind a device or file to the flatimage
@@ -457,8 +544,10 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
     // Set source directory and target compressed file
     fs::path path_file_layer = config.path_dir_host_config / "layer.tmp";
     fs::path path_dir_src = config.path_dir_data_overlayfs / "upperdir";
+    // Leave out configuration writes that were interrupted
+    ns_db::clean(config.path_dir_config);
     // Create filesystem based on the contents of src
-    ns_layers::create(path_dir_src, path_file_layer, config.layer_compression_level);
+    ns_layers::create(path_dir_src, path_file_layer, ns_layers::compression(config), config.opt_layer_compression_budget);
     // Include filesystem in the image
     ns_layers::add(config.path_file_binary, path_file_layer);
     // Remove compressed filesystem
@@ -494,6 +583,26 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
       db("args") = cmd->args;
     }, ns_db::Mode::UPDATE_OR_CREATE);
   } // else if
+  // Update the image from a delta file
+  else if ( auto cmd = ns_variant::get_if_holds_alternative<ns_cmd::ns_update::CmdUpdate>(*variant_cmd) )
+  {
+    if ( cmd->op == ns_cmd::ns_update::CmdUpdateOp::CREATE )
+    {
+      ns_cmd::ns_update::create(config, cmd->args.at(0), cmd->args.at(1));
+    } // if
+    else
+    {
+      ns_cmd::ns_update::apply(config, cmd->args.at(0));
+    } // else
+  } // else if
+  // Run a benchmark
+  else if ( auto cmd = ns_variant::get_if_holds_alternative<ns_cmd::ns_bench::CmdBench>(*variant_cmd) )
+  {
+    switch(cmd->op)
+    {
+      case ns_cmd::ns_bench::CmdBenchOp::PORTAL: ns_cmd::ns_bench::portal(cmd->count); break;
+    } // switch
+  } // else if
   // Update default command on database
   else if ( auto cmd = ns_variant::get_if_holds_alternative<ns_parser::CmdNone>(*variant_cmd) )
   {
@@ -501,26 +610,17 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
     f_bwrap(
       [&]
       {
-        return ns_exception::value_or([&]
-        {
-          std::string program;
-          ns_db::from_file(config.path_file_config_boot, [&](auto& db)
-          {
-            program = db["program"];
-          }, ns_db::Mode::READ);
-          return ns_env::expand(program).value_or(program);
-        }, std::string{"bash"});
+        return ns_db::get<std::string>(config.path_file_config_boot, "program")
+          .transform([](auto&& e){ return ns_env::expand(e).value_or(e); })
+          .value_or("bash");
       }
       ,
       [&]
       {
         return ns_exception::or_default([&]
         {
-          std::vector<std::string> args;
-          ns_db::from_file(config.path_file_config_boot, [&](auto& db)
-          {
-            args = db["args"].as_vector();
-          }, ns_db::Mode::READ);
+          std::vector<std::string> args = ns_db::get<std::vector<std::string>>(config.path_file_config_boot, "args")
+            .value_or(std::vector<std::string>{});
           // Append arguments from argv
           if ( argc > 1 )
           {
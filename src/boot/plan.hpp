@@ -0,0 +1,139 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : plan
+///
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+#include "../cpp/lib/bwrap.hpp"
+#include "../cpp/lib/db.hpp"
+#include "../cpp/lib/sha256.hpp"
+#include "../cpp/std/string.hpp"
+#include "config/config.hpp"
+
+// The launch plan is the sandbox built by the first launch of an image, later launches with the
+// same inputs restore it instead of reading and expanding the configuration again
+
+namespace ns_plan
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+// Takes the place of the instance directory, which is unique to each launch
+constexpr std::string_view const SENTINEL_DIR_INSTANCE = "@FIM_DIR_INSTANCE@";
+
+// Variables that change on every launch without affecting the sandbox, the child inherits them from
+// the host environment instead of the plan
+constexpr std::array<std::string_view,11> const ENV_EXCLUDED =
+{
+    "PID=", "FIM_PID=", "PID_PARENT="
+  , "DESKTOP_STARTUP_ID=", "XDG_ACTIVATION_TOKEN="
+  , "PWD=", "OLDPWD=", "SHLVL=", "_="
+  , "SSH_CLIENT=", "SSH_CONNECTION="
+};
+
+// fn: substitute() {{{
+inline std::vector<std::string> substitute(std::vector<std::string> entries
+  , std::string const& substring
+  , std::string const& replacement)
+{
+  std::ranges::for_each(entries, [&](auto& e){ e = ns_string::replace_substrings(e, substring, replacement); });
+  return entries;
+} // fn: substitute() }}}
+
+} // namespace
+
+// fn: key() {{{
+// What the plan depends on: the user, the permissions, the configuration files, the mounted layers
+// and the host environment
+inline std::expected<std::string,std::string> key(ns_config::FlatimageConfig const& config
+  , ns_bwrap::ns_permissions::PermissionBits bits)
+{
+  std::string str_dir_instance = config.path_dir_instance.string();
+  ns_sha256::Sha256 sha256;
+  auto f_update = [&](std::string const& data)
+  {
+    std::string entry = ns_string::replace_substrings(data, str_dir_instance, std::string{SENTINEL_DIR_INSTANCE});
+    sha256.update(entry.data(), entry.size() + 1);
+  };
+
+  // User and overlay
+  f_update("{}:{}:{}:{}"_fmt(config.is_root, static_cast<int>(config.overlay_type), getuid(), getgid()));
+
+  // Permissions
+  std::ranges::for_each(bits.to_vector_string(), f_update);
+
+  // Configuration files
+  for (fs::path const& path_file_config : { config.path_file_config_bindings, config.path_file_config_environment })
+  {
+    std::ifstream file_config{path_file_config};
+    std::string contents = (file_config.is_open())? ns_string::to_string(file_config.rdbuf()) : "";
+    f_update(contents);
+  } // for
+
+  // Layers
+  for (fs::path const& path_dir_layer : ns_config::get_mounted_layers(config.path_dir_mount_layers))
+  {
+    f_update(path_dir_layer.string());
+  } // for
+
+  // Host environment
+  std::vector<std::string> environment;
+  for (char** i = environ; *i != nullptr; ++i)
+  {
+    std::string_view entry{*i};
+    qcontinue_if(std::ranges::any_of(ENV_EXCLUDED, [&](auto&& e){ return entry.starts_with(e); }));
+    environment.emplace_back(entry);
+  } // for
+  std::ranges::sort(environment);
+  std::ranges::for_each(environment, f_update);
+
+  return sha256.digest();
+} // fn: key() }}}
+
+// fn: load() {{{
+inline std::expected<ns_bwrap::Plan,std::string> load(fs::path const& path_file_plan
+  , std::string const& key
+  , fs::path const& path_dir_instance)
+{
+  return ns_exception::to_expected([&]
+  {
+    auto db = ns_db::Db(path_file_plan, ns_db::Mode::READ);
+    if ( db["key"].as_string() != key ) { "Outdated launch plan"_throw(); }
+    ns_bwrap::Plan plan;
+    plan.args = substitute(db["args"].as_vector(), std::string{SENTINEL_DIR_INSTANCE}, path_dir_instance.string());
+    plan.env = substitute(db["env"].as_vector(), std::string{SENTINEL_DIR_INSTANCE}, path_dir_instance.string());
+    plan.bashrc = db["bashrc"].as_string();
+    return plan;
+  });
+} // fn: load() }}}
+
+// fn: save() {{{
+inline void save(fs::path const& path_file_plan
+  , std::string const& key
+  , fs::path const& path_dir_instance
+  , ns_bwrap::Plan const& plan)
+{
+  ns_log::exception([&]
+  {
+    auto db = ns_db::Db(path_file_plan, ns_db::Mode::CREATE);
+    db("key") = key;
+    db("args") = substitute(plan.args, path_dir_instance.string(), std::string{SENTINEL_DIR_INSTANCE});
+    db("env") = substitute(plan.env, path_dir_instance.string(), std::string{SENTINEL_DIR_INSTANCE});
+    db("bashrc") = plan.bashrc;
+  });
+} // fn: save() }}}
+
+} // namespace ns_plan
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
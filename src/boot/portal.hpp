@@ -5,8 +5,11 @@
 
 #include <thread>
 #include <filesystem>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "../cpp/lib/env.hpp"
+#include "../cpp/lib/ipc.hpp"
 #include "../cpp/lib/subprocess.hpp"
 
 namespace ns_portal
@@ -20,16 +23,24 @@ namespace fs = std::filesystem;
 } // anonymous namespace
 
 // struct Portal {{{
+// The boot process owns the listening socket, the daemon is only spawned once the first guest
+// connects, launches that never call the portal do not pay for it
 struct Portal
 {
-  std::unique_ptr<ns_subprocess::Subprocess> m_process;
+  ns_ipc::Ipc m_ipc;
+  int m_fd_wake;
+  std::thread m_thread;
   fs::path m_path_file_daemon;
   fs::path m_path_file_guest;
 
-  Portal(fs::path const& path_file_reference)
+  Portal(fs::path const& path_file_socket)
+    : m_ipc(ns_ipc::Ipc::host(path_file_socket))
+    , m_fd_wake(eventfd(0, EFD_CLOEXEC))
   {
-    // This is read by the guest to send commands to the daemon
-    ns_env::set("FIM_PORTAL_FILE", path_file_reference, ns_env::Replace::Y);
+    ethrow_if(m_fd_wake < 0, "Could not create eventfd: {}"_fmt(strerror(errno)));
+
+    // This is read by the guest to connect to the daemon
+    ns_env::set("FIM_PORTAL_FILE", path_file_socket, ns_env::Replace::Y);
 
     // Path to flatimage binaries
     const char* str_dir_app_bin = ns_env::get("FIM_DIR_APP_BIN");
@@ -41,20 +52,49 @@ struct Portal
     ethrow_if(not fs::exists(m_path_file_daemon), "Daemon not found in {}"_fmt(m_path_file_daemon));
     ethrow_if(not fs::exists(m_path_file_guest), "Guest not found in {}"_fmt(m_path_file_guest));
 
-    // Create a portal that uses the reference file to create an unique communication key
-    m_process = std::make_unique<ns_subprocess::Subprocess>(m_path_file_daemon);
+    // Wait for the first connection in the background
+    m_thread = std::thread([this]{ activate(); });
+  } // Portal
+
+  Portal(Portal const&) = delete;
+  Portal& operator=(Portal const&) = delete;
+
+  // activate() {{{
+  // The daemon is a child of this thread, which lives until destruction so the death signal of the
+  // daemon is not triggered early
+  void activate()
+  {
+    auto f_wait = [this](bool is_listening)
+    {
+      pollfd fds[]{ { .fd = m_fd_wake, .events = POLLIN, .revents = 0 }, { .fd = m_ipc.fd(), .events = POLLIN, .revents = 0 } };
+      while ( poll(fds, (is_listening)? 2 : 1, -1) < 0 and errno == EINTR ) {}
+      return not (fds[0].revents & POLLIN);
+    };
+
+    // Stopped before any guest connected
+    qreturn_if(not f_wait(true));
 
-    // Spawn process to background
-    std::ignore = m_process->with_piped_outputs()
+    // Hand the listening socket to the daemon, it accepts the pending connection
+    ns_log::debug()("Activate portal daemon");
+    auto process = std::make_unique<ns_subprocess::Subprocess>(m_path_file_daemon);
+    std::ignore = process->with_piped_outputs()
       .with_die_on_pid(getpid())
-      .with_args(path_file_reference)
+      .with_inherited_fd(m_ipc.fd())
+      .with_args(m_ipc.fd())
       .spawn();
-  } // Portal
+
+    // Wait for destruction
+    std::ignore = f_wait(false);
+    process->kill(SIGTERM);
+    std::ignore = process->wait();
+  } // activate() }}}
 
   ~Portal()
   {
-    m_process->kill(SIGTERM);
-    std::ignore = m_process->wait();
+    uint64_t value = 1;
+    elog_if(write(m_fd_wake, &value, sizeof(value)) != sizeof(value), "Could not stop portal: {}"_fmt(strerror(errno)));
+    if ( m_thread.joinable() ) { m_thread.join(); }
+    close(m_fd_wake);
   } // ~Portal()
 }; // struct Portal }}}
 
@@ -9,7 +9,10 @@
 #include <filesystem>
 #include <sys/types.h>
 #include <pwd.h>
+#include <future>
 #include <regex>
+#include <sys/mman.h>
+#include <sys/utsname.h>
 
 #include "../std/vector.hpp"
 #include "../std/functional.hpp"
@@ -19,6 +22,7 @@
 #include "match.hpp"
 #include "subprocess.hpp"
 #include "env.hpp"
+#include "sha256.hpp"
 #include "reserved/permissions.hpp"
 
 namespace ns_bwrap
@@ -38,6 +42,49 @@ struct Overlay
   fs::path path_dir_work;
 };
 
+// Arguments and environment of the sandbox, without the program to run and the gpu bindings
+struct Plan
+{
+  std::vector<std::string> args;
+  std::vector<std::string> env;
+  std::string bashrc;
+};
+
+// Bwrap installed by flatimage when the bundled binary is restricted
+constexpr std::string_view const PATH_FILE_BWRAP_OPT = "/opt/flatimage/bwrap";
+
+// path_file_probe_cache() {{{
+// Result of the last bwrap probe, shared by all images of the user
+inline std::optional<fs::path> path_file_probe_cache()
+{
+  auto opt_path_dir_cache = ns_env::xdg_cache_home<std::string>();
+  qreturn_if(not opt_path_dir_cache, std::nullopt);
+  return fs::path{*opt_path_dir_cache} / "flatimage" / "bwrap.json";
+} // path_file_probe_cache() }}}
+
+// probe_key() {{{
+// What a bwrap probe depends on: the bwrap binary, the kernel and the sysctls that restrict
+// unprivileged user namespaces
+inline std::expected<std::string, std::string> probe_key(fs::path const& path_file_bwrap)
+{
+  auto expected_digest = ns_sha256::file(path_file_bwrap);
+  qreturn_if(not expected_digest, std::unexpected(expected_digest.error()));
+  utsname uts;
+  qreturn_if(uname(&uts) < 0, std::unexpected("Could not read kernel release: {}"_fmt(strerror(errno))));
+  std::string key = "{}:{}"_fmt(*expected_digest, uts.release);
+  for (auto&& path_file_sysctl : { "/proc/sys/kernel/apparmor_restrict_unprivileged_userns"
+    , "/proc/sys/kernel/unprivileged_userns_clone"
+    , "/proc/sys/user/max_user_namespaces" })
+  {
+    // Missing sysctls are part of the key as empty values
+    std::string value;
+    std::ifstream file_sysctl(path_file_sysctl);
+    std::getline(file_sysctl, value);
+    key += ":" + value;
+  } // for
+  return key;
+} // probe_key() }}}
+
 namespace ns_permissions
 {
 
@@ -61,6 +108,8 @@ class Bwrap
     std::optional<fs::path> m_opt_path_dir_work;
     // Arguments and environment to bwrap
     std::vector<std::string> m_args;
+    // Contents of the bashrc file
+    std::string m_bashrc;
     // Run bwrap with uid and gid equal to 0
     bool m_is_root;
     // Bwrap native --overlay options
@@ -69,7 +118,10 @@ class Bwrap
       , fs::path const& path_dir_work);
     // Set XDG_RUNTIME_DIR
     void set_xdg_runtime_dir();
+    // Write the bashrc file
+    void write_bashrc(fs::path const& path_file_bashrc);
     // Setup
+    std::expected<fs::path, std::string> probe(fs::path const& path_file_bwrap);
     std::expected<fs::path, std::string> test_and_setup(fs::path const& path_file_bwrap);
 
   public:
@@ -81,6 +133,12 @@ class Bwrap
       , fs::path const& path_file_program
       , std::vector<std::string> const& program_args
       , std::vector<std::string> const& program_env);
+    Bwrap(bool is_root
+      , std::optional<fs::path> opt_path_dir_work
+      , fs::path const& path_file_bashrc
+      , Plan const& plan
+      , fs::path const& path_file_program
+      , std::vector<std::string> const& program_args);
     ~Bwrap();
     Bwrap(Bwrap const&) = delete;
     Bwrap(Bwrap&&) = delete;
@@ -102,7 +160,9 @@ class Bwrap
     Bwrap& with_bind_gpu(fs::path const& path_dir_root_guest, fs::path const& path_dir_root_host);
     Bwrap& with_bind(fs::path const& src, fs::path const& dst);
     Bwrap& with_bind_ro(fs::path const& src, fs::path const& dst);
-    [[nodiscard]] std::pair<int,int> run(ns_permissions::PermissionBits const& permissions);
+    Bwrap& with_permissions(ns_permissions::PermissionBits const& permissions);
+    [[nodiscard]] Plan plan() const;
+    [[nodiscard]] std::pair<int,int> run();
 }; // class: Bwrap
 
 // Bwrap() {{{
@@ -132,23 +192,18 @@ inline Bwrap::Bwrap(
   } // if
 
   // Setup PS1
-  std::ofstream of{path_file_bashrc};
-  if ( of.is_open() )
+  if ( auto it = std::ranges::find_if(program_env, [](auto&& e){ return e.starts_with("PS1="); });
+  it != std::ranges::end(program_env))
   {
-    if ( auto it = std::ranges::find_if(program_env, [](auto&& e){ return e.starts_with("PS1="); });
-    it != std::ranges::end(program_env))
-    {
-      std::string ps1{*it};
-      ps1.erase(0, ps1.find('=')+1);
-      of << "export PS1=" << '"' << ps1 << '"';
-    } // if
-    else
-    {
-      of << R"(export PS1="[flatimage-${FIM_DIST,,}] \W → ")";
-    } // else
-    ns_env::set("BASHRC_FILE", path_file_bashrc.c_str(), ns_env::Replace::Y);
+    std::string ps1{*it};
+    ps1.erase(0, ps1.find('=')+1);
+    m_bashrc = "export PS1=\"{}\""_fmt(ps1);
   } // if
-  of.close();
+  else
+  {
+    m_bashrc = R"(export PS1="[flatimage-${FIM_DIST,,}] \W → ")";
+  } // else
+  write_bashrc(path_file_bashrc);
 
   // Check if should be root in the container
   if ( m_is_root )
@@ -187,6 +242,27 @@ inline Bwrap::Bwrap(
   set_xdg_runtime_dir();
 } // Bwrap() }}}
 
+// Bwrap() {{{
+// Restores a sandbox from the plan of a previous launch
+inline Bwrap::Bwrap(
+      bool is_root
+    , std::optional<fs::path> opt_path_dir_work
+    , fs::path const& path_file_bashrc
+    , Plan const& plan
+    , fs::path const& path_file_program
+    , std::vector<std::string> const& program_args)
+  : m_path_file_program(path_file_program)
+  , m_program_args(program_args)
+  , m_program_env(plan.env)
+  , m_path_dir_xdg_runtime(ns_env::get_or_else("XDG_RUNTIME_DIR", "/run/user/{}"_fmt(getuid())))
+  , m_opt_path_dir_work(opt_path_dir_work)
+  , m_args(plan.args)
+  , m_bashrc(plan.bashrc)
+  , m_is_root(is_root)
+{
+  write_bashrc(path_file_bashrc);
+} // Bwrap() }}}
+
 // ~Bwrap() {{{
 inline Bwrap::~Bwrap()
 {
@@ -224,8 +300,25 @@ inline void Bwrap::set_xdg_runtime_dir()
   ns_vector::push_back(m_args, "--setenv", "XDG_RUNTIME_DIR", m_path_dir_xdg_runtime);
 } // set_xdg_runtime_dir() }}}
 
-// test_and_setup() {{{
-inline std::expected<fs::path, std::string> Bwrap::test_and_setup(fs::path const& path_file_bwrap_src)
+// write_bashrc() {{{
+// The file is shared by the instances of the application, only write it when it changes
+inline void Bwrap::write_bashrc(fs::path const& path_file_bashrc)
+{
+  std::ifstream file_bashrc{path_file_bashrc};
+  bool is_current = file_bashrc.is_open() and ns_string::to_string(file_bashrc.rdbuf()) == m_bashrc;
+  file_bashrc.close();
+  if ( not is_current )
+  {
+    std::ofstream of{path_file_bashrc};
+    ereturn_if(not of.is_open(), "Could not open bashrc file '{}'"_fmt(path_file_bashrc));
+    of << m_bashrc;
+  } // if
+  ns_env::set("BASHRC_FILE", path_file_bashrc.c_str(), ns_env::Replace::Y);
+} // write_bashrc() }}}
+
+// probe() {{{
+// Finds a bwrap binary that can create the sandbox in this system
+inline std::expected<fs::path, std::string> Bwrap::probe(fs::path const& path_file_bwrap_src)
 {
   // Test current bwrap binary
   auto ret = ns_subprocess::Subprocess(path_file_bwrap_src)
@@ -235,7 +328,7 @@ inline std::expected<fs::path, std::string> Bwrap::test_and_setup(fs::path const
     .wait();
   qreturn_if (ret and *ret == 0, path_file_bwrap_src);
   // Try to use bwrap installed by flatimage
-  fs::path path_file_bwrap_opt = "/opt/flatimage/bwrap";
+  fs::path path_file_bwrap_opt = PATH_FILE_BWRAP_OPT;
   ret = ns_subprocess::Subprocess(path_file_bwrap_opt)
     .with_piped_outputs()
     .with_args("--bind", "/", "/", "bash", "-c", "echo")
@@ -256,19 +349,106 @@ inline std::expected<fs::path, std::string> Bwrap::test_and_setup(fs::path const
   qreturn_if(not ret, std::unexpected("Could not find create profile (abnormal exit)"));
   qreturn_if(ret and *ret != 0, std::unexpected("Could not find create profile with exit code '{}'"_fmt(*ret)));
   return path_file_bwrap_opt;
+} // probe() }}}
+
+// test_and_setup() {{{
+// Probes bwrap, the result is reused by later launches while its probe key does not change. The
+// cache is shared by all images of the user, so it records which candidate won instead of its path,
+// which is under the mount directory of the image that probed
+inline std::expected<fs::path, std::string> Bwrap::test_and_setup(fs::path const& path_file_bwrap_src)
+{
+  auto opt_path_file_cache = path_file_probe_cache();
+  auto expected_key = probe_key(path_file_bwrap_src);
+  elog_if(not expected_key, expected_key.error());
+
+  // Reuse previous result
+  if ( opt_path_file_cache and expected_key )
+  {
+    auto expected_path_file_bwrap = ns_exception::to_expected([&]
+    {
+      auto db = ns_db::Db(*opt_path_file_cache, ns_db::Mode::READ);
+      if ( db["key"].as_string() != *expected_key ) { "Outdated bwrap probe"_throw(); }
+      std::string candidate = db["bwrap"].as_string();
+      if ( candidate != "bundled" and candidate != PATH_FILE_BWRAP_OPT )
+      {
+        "Unknown bwrap candidate '{}'"_throw(candidate);
+      } // if
+      return ( candidate == "bundled" )? path_file_bwrap_src : fs::path{PATH_FILE_BWRAP_OPT};
+    });
+    if ( expected_path_file_bwrap and fs::exists(*expected_path_file_bwrap) )
+    {
+      ns_log::debug()("Using cached bwrap probe '{}'", *expected_path_file_bwrap);
+      return *expected_path_file_bwrap;
+    } // if
+    ns_log::debug()("Probe bwrap: {}", expected_path_file_bwrap.error_or("binary is missing"));
+  } // if
+
+  auto expected_path_file_bwrap = probe(path_file_bwrap_src);
+
+  // Save result
+  if ( expected_path_file_bwrap and opt_path_file_cache and expected_key )
+  {
+    ns_log::exception([&]
+    {
+      fs::create_directories(opt_path_file_cache->parent_path());
+      auto db = ns_db::Db(*opt_path_file_cache, ns_db::Mode::CREATE);
+      db("key") = *expected_key;
+      db("bwrap") = ( *expected_path_file_bwrap == path_file_bwrap_src )?
+          std::string{"bundled"}
+        : expected_path_file_bwrap->string();
+    });
+  } // if
+
+  return expected_path_file_bwrap;
 } // test_and_setup() }}}
 
+// gpu_key() {{{
+// What the nvidia links depend on: the driver version, the contents of the searched directories
+// and the roots the links are created between
+inline std::string gpu_key(std::vector<fs::path> const& vec_path_dir_search
+  , fs::path const& path_dir_root_guest
+  , fs::path const& path_dir_root_host)
+{
+  std::string version;
+  std::ifstream file_version("/proc/driver/nvidia/version");
+  std::getline(file_version, version);
+  std::string key = "{}:{}:{}"_fmt(version, path_dir_root_guest, path_dir_root_host);
+  for (fs::path const& path_dir_search : vec_path_dir_search)
+  {
+    std::error_code ec;
+    auto time = fs::last_write_time(path_dir_search, ec);
+    key += ":{}"_fmt((ec)? 0 : time.time_since_epoch().count());
+  } // for
+  return key;
+} // gpu_key() }}}
+
 // symlink_nvidia() {{{
 inline Bwrap& Bwrap::symlink_nvidia(fs::path const& path_dir_root_guest, fs::path const& path_dir_root_host)
 {
-  std::regex regex_exclude("gst|icudata|egl-wayland", std::regex_constants::extended);
+  // Directories to search and the keywords of the files to link from each
+  std::vector<std::pair<fs::path, std::vector<std::string_view>>> vec_search
+  {
+    { "/usr/lib", { "nvidia", "cuda", "nvcuvid", "nvoptix" } },
+    { "/usr/lib/x86_64-linux-gnu", { "nvidia", "cuda", "nvcuvid", "nvoptix" } },
+    { "/usr/lib/i386-linux-gnu", { "nvidia", "cuda", "nvcuvid", "nvoptix" } },
+    { "/usr/bin", { "nvidia" } },
+    { "/usr/share", { "nvidia" } },
+    { "/usr/share/vulkan/icd.d", { "nvidia" } },
+    { "/usr/lib32", { "nvidia", "cuda" } },
+  };
 
-  auto f_find_and_bind = [&]<typename... Args>(fs::path const& path_dir_search, Args&&... args)
+  // Links as pairs of name and target
+  using Links = std::vector<std::pair<fs::path,fs::path>>;
+
+  auto f_find = [&](fs::path const& path_dir_search, std::vector<std::string_view> const& keywords)
   {
-    std::vector<std::string_view> keywords{std::forward<Args>(args)...};
-    ireturn_if(not fs::exists(path_dir_search), "Search path does not exist: '{}'"_fmt(path_dir_search));
-    for(auto&& path_file_entry : fs::directory_iterator(path_dir_search) | std::views::transform([](auto&& e){ return e.path(); }))
+    Links links;
+    std::regex regex_exclude("gst|icudata|egl-wayland", std::regex_constants::extended);
+    ireturn_if(not fs::exists(path_dir_search), "Search path does not exist: '{}'"_fmt(path_dir_search), links);
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(path_dir_search, ec); not ec and it != fs::directory_iterator(); it.increment(ec))
     {
+      fs::path path_file_entry = it->path();
       // Skip ignored matches
       dcontinue_if(std::regex_search(path_file_entry.c_str(), regex_exclude), "Ignoring match '{}'"_fmt(path_file_entry));
       // Skip directories
@@ -279,31 +459,87 @@ inline Bwrap& Bwrap::symlink_nvidia(fs::path const& path_dir_root_guest, fs::pat
       auto path_file_entry_realpath = ns_filesystem::ns_path::realpath(path_file_entry);
       econtinue_if(not path_file_entry_realpath, "Broken symlink: '{}'"_fmt(path_file_entry));
       // Create target and symlink names
-      fs::path path_link_target = path_dir_root_host / path_file_entry_realpath->relative_path();
-      fs::path path_link_name = path_dir_root_guest / path_file_entry.relative_path();
-      // File already exists in the container as a regular file or directory, skip
-      qcontinue_if(fs::exists(path_link_name) and not fs::is_symlink(path_link_name));
-      // Create parent directories
-      std::error_code ec;
-      fs::create_directories(path_link_name.parent_path(), ec);
-      econtinue_if (ec, ec.message());
-      // Remove existing link
-      fs::remove(path_link_name, ec);
-      // Symlink
-      econtinue_if(symlink(path_link_target.c_str(), path_link_name.c_str()) < 0, "{}: {}"_fmt(strerror(errno), path_link_name));
-      // Log symlink successful
-      ns_log::debug()("PERM(NVIDIA): {} -> {}", path_link_name, path_link_target);
+      links.emplace_back(path_dir_root_guest / path_file_entry.relative_path()
+        , path_dir_root_host / path_file_entry_realpath->relative_path()
+      );
     } // for
+    return links;
+  };
+
+  auto f_link = [](fs::path const& path_link_name, fs::path const& path_link_target)
+  {
+    // File already exists in the container as a regular file or directory, skip
+    qreturn_if(fs::exists(path_link_name) and not fs::is_symlink(path_link_name));
+    // Create parent directories
+    std::error_code ec;
+    fs::create_directories(path_link_name.parent_path(), ec);
+    ereturn_if (ec, ec.message());
+    // Remove existing link
+    fs::remove(path_link_name, ec);
+    // Symlink
+    ereturn_if(symlink(path_link_target.c_str(), path_link_name.c_str()) < 0, "{}: {}"_fmt(strerror(errno), path_link_name));
+    // Log symlink successful
+    ns_log::debug()("PERM(NVIDIA): {} -> {}", path_link_name, path_link_target);
   };
 
-  // Bind files
-  f_find_and_bind("/usr/lib", "nvidia", "cuda", "nvcuvid", "nvoptix");
-  f_find_and_bind("/usr/lib/x86_64-linux-gnu", "nvidia", "cuda", "nvcuvid", "nvoptix");
-  f_find_and_bind("/usr/lib/i386-linux-gnu", "nvidia", "cuda", "nvcuvid", "nvoptix");
-  f_find_and_bind("/usr/bin", "nvidia");
-  f_find_and_bind("/usr/share", "nvidia");
-  f_find_and_bind("/usr/share/vulkan/icd.d", "nvidia");
-  f_find_and_bind("/usr/lib32", "nvidia", "cuda");
+  // Manifest of the links created by a previous launch
+  const char* str_dir_config = ns_env::get("FIM_DIR_CONFIG");
+  std::optional<fs::path> opt_path_file_manifest = (str_dir_config)?
+      std::make_optional(fs::path{str_dir_config} / "gpu.json")
+    : std::nullopt;
+  std::string key = gpu_key(vec_search
+      | std::views::transform([](auto&& e){ return e.first; })
+      | std::ranges::to<std::vector<fs::path>>()
+    , path_dir_root_guest
+    , path_dir_root_host
+  );
+
+  // Nothing changed, only restore links that went missing from the guest
+  auto expected_links = ns_exception::to_expected([&]
+  {
+    ethrow_if(not opt_path_file_manifest, "FIM_DIR_CONFIG is undefined");
+    auto db = ns_db::Db(*opt_path_file_manifest, ns_db::Mode::READ);
+    if ( db["key"].as_string() != key ) { "Outdated gpu manifest"_throw(); }
+    std::vector<std::string> vec_names = db["names"].as_vector();
+    std::vector<std::string> vec_targets = db["targets"].as_vector();
+    if ( vec_names.size() != vec_targets.size() ) { "Corrupted gpu manifest"_throw(); }
+    Links links;
+    for (size_t i = 0; i < vec_names.size(); ++i) { links.emplace_back(vec_names[i], vec_targets[i]); }
+    return links;
+  });
+  if ( expected_links )
+  {
+    ns_log::debug()("PERM(NVIDIA): Using manifest with {} links", expected_links->size());
+    for (auto&& [path_link_name, path_link_target] : *expected_links)
+    {
+      qcontinue_if(fs::is_symlink(path_link_name));
+      f_link(path_link_name, path_link_target);
+    } // for
+  } // if
+  // Scan the directories in parallel and re-create the links
+  else
+  {
+    ns_log::debug()("PERM(NVIDIA): Scan directories: {}", expected_links.error());
+    std::vector<std::future<Links>> futures;
+    for (auto&& [path_dir_search, keywords] : vec_search)
+    {
+      futures.push_back(std::async(std::launch::async, f_find, std::cref(path_dir_search), std::cref(keywords)));
+    } // for
+    Links links;
+    for (auto&& future : futures) { std::ranges::move(future.get(), std::back_inserter(links)); }
+    std::ranges::for_each(links, [&](auto&& e){ f_link(e.first, e.second); });
+    // Save manifest
+    if ( opt_path_file_manifest )
+    {
+      ns_log::exception([&]
+      {
+        auto db = ns_db::Db(*opt_path_file_manifest, ns_db::Mode::CREATE);
+        db("key") = key;
+        db("names") = links | std::views::transform([](auto&& e){ return e.first.string(); }) | std::ranges::to<std::vector<std::string>>();
+        db("targets") = links | std::views::transform([](auto&& e){ return e.second.string(); }) | std::ranges::to<std::vector<std::string>>();
+      });
+    } // if
+  } // else
 
   // Bind devices
   for(auto&& entry : fs::directory_iterator("/dev")
@@ -323,7 +559,8 @@ inline Bwrap& Bwrap::with_binds_from_file(fs::path const& path_file_bindings)
   ns_exception::ignore([&]
   {
     auto db = ns_db::Db(path_file_bindings, ns_db::Mode::READ);
-    for(auto&& key : ns_db::Db(path_file_bindings, ns_db::Mode::READ).keys())
+    ns_env::Snapshot snapshot;
+    for(auto&& key : db.keys())
     {
       auto const& binding = db[key];
       m_args.push_back(ns_match::match(std::string{binding["type"]}
@@ -331,8 +568,10 @@ inline Bwrap& Bwrap::with_binds_from_file(fs::path const& path_file_bindings)
         , ns_match::equal("rw") >>= std::string{"--bind-try"}
         , ns_match::equal("dev") >>= std::string{"--dev-bind-try"}
       ));
-      m_args.push_back(ns_env::expand(binding["src"]).value_or(binding["src"]));
-      m_args.push_back(ns_env::expand(binding["dst"]).value_or(binding["dst"]));
+      std::string src = binding["src"];
+      std::string dst = binding["dst"];
+      m_args.push_back(ns_env::expand(src, snapshot).value_or(src));
+      m_args.push_back(ns_env::expand(dst, snapshot).value_or(dst));
     } // for
   });
 
@@ -519,8 +758,8 @@ inline Bwrap& Bwrap::with_bind_gpu(fs::path const& path_dir_root_guest, fs::path
   return *this;
 } // with_bind_gpu() }}}
 
-// run() {{{
-inline std::pair<int,int> Bwrap::run(ns_permissions::PermissionBits const& permissions)
+// with_permissions() {{{
+inline Bwrap& Bwrap::with_permissions(ns_permissions::PermissionBits const& permissions)
 {
   // Configure bindings
   ns_functional::call_if(permissions.home        , [&]{ bind_home()        ; });
@@ -534,10 +773,18 @@ inline std::pair<int,int> Bwrap::run(ns_permissions::PermissionBits const& permi
   ns_functional::call_if(permissions.input       , [&]{ bind_input()       ; });
   ns_functional::call_if(permissions.usb         , [&]{ bind_usb()         ; });
   ns_functional::call_if(permissions.network     , [&]{ bind_network()     ; });
+  return *this;
+} // with_permissions() }}}
 
-  auto opt_path_file_bash = ns_subprocess::search_path("bash");
-  ethrow_if(not opt_path_file_bash.has_value(), "Could not find bash");
+// plan() {{{
+inline Plan Bwrap::plan() const
+{
+  return Plan{ .args = m_args, .env = m_program_env, .bashrc = m_bashrc };
+} // plan() }}}
 
+// run() {{{
+inline std::pair<int,int> Bwrap::run()
+{
   // Use builtin bwrap or native if exists
   auto opt_path_file_bwrap = ns_subprocess::search_path("bwrap");
   ethrow_if(not opt_path_file_bwrap.has_value(), "Could not find bwrap");
@@ -555,16 +802,35 @@ inline std::pair<int,int> Bwrap::run(ns_permissions::PermissionBits const& permi
   // Configure pipe read end as non-blocking
   fcntl(pipe_error[0], F_SETFL, fcntl(pipe_error[0], F_GETFL, 0) | O_NONBLOCK);
 
+  // Options go through a sealed memfd read by '--args', which keeps them off the command line
+  int fd_args = memfd_create("fim_bwrap_args", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  ethrow_if(fd_args < 0, "Could not create memfd for bwrap arguments: {}"_fmt(strerror(errno)));
+  std::string args;
+  std::ranges::for_each(m_args, [&](auto&& e){ args.append(e); args.push_back('\0'); });
+  for (size_t offset = 0; offset < args.size();)
+  {
+    ssize_t bytes = write(fd_args, args.data() + offset, args.size() - offset);
+    if ( bytes < 0 and errno == EINTR ) { continue; }
+    if ( bytes <= 0 ) { close(fd_args); "Could not write bwrap arguments: {}"_throw(strerror(errno)); }
+    offset += bytes;
+  } // for
+  elog_if(fcntl(fd_args, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0
+    , "Could not seal bwrap arguments: {}"_fmt(strerror(errno))
+  );
+  // bwrap reads from the current offset
+  lseek(fd_args, 0, SEEK_SET);
+
   // Run Bwrap
-  auto ret = ns_subprocess::Subprocess(*opt_path_file_bash)
-    .with_args("-c", R"("{}" "$@")"_fmt(*expected_path_file_bwrap), "--")
+  auto ret = ns_subprocess::Subprocess(*expected_path_file_bwrap)
+    .with_inherited_fd(fd_args)
     .with_args("--error-fd", std::to_string(pipe_error[1]))
-    .with_args(m_args)
+    .with_args("--args", std::to_string(fd_args))
     .with_args(m_path_file_program)
     .with_args(m_program_args)
     .with_env(m_program_env)
     .spawn()
     .wait();
+  close(fd_args);
   if ( not ret ) { ns_log::error()("bwrap exited abnormally"); }
   if ( *ret != 0 ) { ns_log::error()("bwrap exited with non-zero exit code '{}'", *ret); }
 
@@ -576,6 +842,12 @@ inline std::pair<int,int> Bwrap::run(ns_permissions::PermissionBits const& permi
   elog_if(read(pipe_error[0], &syscall_nr, sizeof(syscall_nr)) < 0, "Could not read syscall error");
   elog_if(read(pipe_error[0], &errno_nr, sizeof(errno_nr)) < 0, "Could not read errno number");
 
+  // The sandbox could not be set up, probe again on the next launch
+  if ( syscall_nr >= 0 )
+  {
+    if ( auto opt_path_file_cache = path_file_probe_cache() ) { lec(fs::remove, *opt_path_file_cache); }
+  } // if
+
   // Close pipe
   close(pipe_error[0]);
   close(pipe_error[1]);
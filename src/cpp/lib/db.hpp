@@ -5,13 +5,25 @@
 
 #pragma once
 
+#include <charconv>
+#include <csignal>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <set>
+#include <unordered_map>
+#include <utility>
 #include <variant>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "log.hpp"
+#include "env.hpp"
+#include "sha256.hpp"
 #include "../common.hpp"
 #include "../macro.hpp"
 #include "../std/enum.hpp"
@@ -28,6 +40,97 @@ namespace fs = std::filesystem;
 using json_t = nlohmann::json;
 using Exception = json_t::exception;
 
+// class Lock {{{
+// Exclusive advisory lock held through a descriptor, released once destroyed
+class Lock
+{
+  private:
+    int m_fd;
+  public:
+    explicit Lock(int fd = -1) : m_fd(fd) {}
+    Lock(Lock const&) = delete;
+    Lock& operator=(Lock const&) = delete;
+    Lock(Lock&& other) noexcept : m_fd(std::exchange(other.m_fd, -1)) {}
+    Lock& operator=(Lock&& other) noexcept { std::swap(m_fd, other.m_fd); return *this; }
+    ~Lock() { if ( m_fd >= 0 ) { close(m_fd); } }
+}; // class Lock }}}
+
+// fn: lock() {{{
+// Serializes the writers of a file with an advisory lock on a separate file, the lock file is kept
+// because the file itself is replaced on every write. Lock files live in the cache directory, so
+// they stay out of the directories that are packed or shown to the guest
+inline std::expected<Lock,std::string> lock(fs::path const& path_file)
+{
+  auto opt_path_dir_cache = ns_env::xdg_cache_home<std::string>();
+  qreturn_if(not opt_path_dir_cache, std::unexpected("Could not determine XDG_CACHE_HOME"));
+  std::string str_path_file = fs::absolute(path_file).string();
+  std::string digest = ns_sha256::Sha256().update(str_path_file.data(), str_path_file.size()).digest();
+  fs::path path_dir_lock = fs::path{*opt_path_dir_cache} / "flatimage" / "lock";
+  std::error_code ec;
+  fs::create_directories(path_dir_lock, ec);
+  qreturn_if(ec, std::unexpected("Could not create lock directory '{}': {}"_fmt(path_dir_lock, ec.message())));
+  fs::path path_file_lock = path_dir_lock / "{}.lock"_fmt(digest);
+  int fd = open(path_file_lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  qreturn_if(fd < 0, std::unexpected("Could not open lock '{}': {}"_fmt(path_file_lock, strerror(errno))));
+  Lock lock_file(fd);
+  int ret;
+  while ( (ret = flock(fd, LOCK_EX)) < 0 and errno == EINTR ) {}
+  qreturn_if(ret < 0, std::unexpected("Could not lock '{}': {}"_fmt(path_file_lock, strerror(errno))));
+  return lock_file;
+} // fn: lock() }}}
+
+// fn: commit() {{{
+// Replaces the file atomically, readers see either the previous or the new contents, also after a
+// crash. The previous permissions are kept
+inline std::expected<void,std::string> commit(fs::path const& path_file, std::string const& contents)
+{
+  fs::path path_dir = (path_file.has_parent_path())? path_file.parent_path() : fs::path{"."};
+  fs::path path_file_tmp = path_dir / ".{}.{}.tmp"_fmt(path_file.filename(), getpid());
+
+  int fd = open(path_file_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  qreturn_if(fd < 0, std::unexpected("Could not open '{}': {}"_fmt(path_file_tmp, strerror(errno))));
+  auto f_fail = [&](std::string const& msg)
+  {
+    int err = errno;
+    close(fd);
+    unlink(path_file_tmp.c_str());
+    return std::unexpected("{} '{}': {}"_fmt(msg, path_file_tmp, strerror(err)));
+  };
+
+  // Keep permissions of the replaced file
+  if ( struct stat st; stat(path_file.c_str(), &st) == 0 )
+  {
+    elog_if(fchmod(fd, st.st_mode & 07777) < 0, "Could not keep permissions of '{}': {}"_fmt(path_file, strerror(errno)));
+  } // if
+
+  // Write and flush to the disk before it becomes visible
+  for (size_t offset = 0; offset < contents.size();)
+  {
+    ssize_t bytes = write(fd, contents.data() + offset, contents.size() - offset);
+    if ( bytes < 0 and errno == EINTR ) { continue; }
+    if ( bytes <= 0 ) { return f_fail("Could not write"); }
+    offset += bytes;
+  } // for
+  if ( fsync(fd) < 0 ) { return f_fail("Could not sync"); }
+  close(fd);
+
+  // Replace
+  if ( rename(path_file_tmp.c_str(), path_file.c_str()) < 0 )
+  {
+    int err = errno;
+    unlink(path_file_tmp.c_str());
+    return std::unexpected("Could not replace '{}': {}"_fmt(path_file, strerror(err)));
+  } // if
+
+  // Flush the directory entry
+  int fd_dir = open(path_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  qreturn_if(fd_dir < 0, std::unexpected("Could not open '{}': {}"_fmt(path_dir, strerror(errno))));
+  elog_if(fsync(fd_dir) < 0, "Could not sync '{}': {}"_fmt(path_dir, strerror(errno)));
+  close(fd_dir);
+
+  return {};
+} // fn: commit() }}}
+
 } // anonymous namespace
 
 // READ             : Reads existing database
@@ -36,6 +139,166 @@ using Exception = json_t::exception;
 // UPDATE_OR_CREATE : Updates existing database or creates a new one
 ENUM(Mode, READ, CREATE, UPDATE, UPDATE_OR_CREATE);
 
+// Y : Keep a binary copy of the parsed file in the cache directory for the next processes
+// N : Only keep the parsed file in this process
+enum class Persist
+{
+  Y,
+  N,
+};
+
+// class Snapshot {{{
+// Parsed files shared by the process, a file is parsed again once its modification time, size or
+// inode change
+class Snapshot
+{
+  private:
+    struct Stamp
+    {
+      int64_t mtime;
+      int64_t size;
+      uint64_t inode;
+      bool operator==(Stamp const&) const = default;
+    };
+    struct Entry
+    {
+      Stamp stamp;
+      std::shared_ptr<json_t const> json;
+    };
+    std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_entries;
+    Snapshot() = default;
+    static std::optional<fs::path> path_file_cache(fs::path const& path_file);
+    static std::shared_ptr<json_t const> read_cache(fs::path const& path_file_cache
+      , fs::path const& path_file
+      , Stamp const& stamp);
+    static void write_cache(fs::path const& path_file_cache
+      , fs::path const& path_file
+      , Stamp const& stamp
+      , json_t const& json);
+  public:
+    static Snapshot& get();
+    std::shared_ptr<json_t const> load(fs::path const& path_file, Persist persist = Persist::N);
+    void evict(fs::path const& path_file);
+}; // class Snapshot }}}
+
+// Snapshot::get() {{{
+inline Snapshot& Snapshot::get()
+{
+  static Snapshot snapshot;
+  return snapshot;
+} // Snapshot::get() }}}
+
+// Snapshot::path_file_cache() {{{
+inline std::optional<fs::path> Snapshot::path_file_cache(fs::path const& path_file)
+{
+  auto opt_path_dir_cache = ns_env::xdg_cache_home<std::string>();
+  qreturn_if(not opt_path_dir_cache, std::nullopt);
+  std::string str_path_file = fs::absolute(path_file).string();
+  std::string digest = ns_sha256::Sha256().update(str_path_file.data(), str_path_file.size()).digest();
+  return fs::path{*opt_path_dir_cache} / "flatimage" / "db" / "{}.cbor"_fmt(digest);
+} // Snapshot::path_file_cache() }}}
+
+// Snapshot::read_cache() {{{
+// Returns null if the cache is missing, corrupted or outdated
+inline std::shared_ptr<json_t const> Snapshot::read_cache(fs::path const& path_file_cache
+  , fs::path const& path_file
+  , Stamp const& stamp)
+{
+  std::ifstream file_cache(path_file_cache, std::ios::binary);
+  qreturn_if(not file_cache.is_open(), nullptr);
+  json_t cache = json_t::from_cbor(file_cache, true, false);
+  qreturn_if(cache.is_discarded() or not cache.is_object(), nullptr);
+  auto f_equal = [&](char const* key, auto&& value)
+  {
+    auto it = cache.find(key);
+    return it != cache.end() and *it == value;
+  };
+  qreturn_if(not f_equal("path", fs::absolute(path_file).string())
+    or not f_equal("mtime", stamp.mtime)
+    or not f_equal("size", stamp.size)
+    or not f_equal("inode", stamp.inode)
+    or not cache.contains("data")
+    , nullptr
+  );
+  return std::make_shared<json_t const>(std::move(cache["data"]));
+} // Snapshot::read_cache() }}}
+
+// Snapshot::write_cache() {{{
+// The cache is replaced atomically, concurrent readers see either version
+inline void Snapshot::write_cache(fs::path const& path_file_cache
+  , fs::path const& path_file
+  , Stamp const& stamp
+  , json_t const& json)
+{
+  std::error_code ec;
+  fs::create_directories(path_file_cache.parent_path(), ec);
+  ereturn_if(ec, "Could not create cache directory '{}': {}"_fmt(path_file_cache.parent_path(), ec.message()));
+  json_t cache =
+  {
+    { "path", fs::absolute(path_file).string() },
+    { "mtime", stamp.mtime },
+    { "size", stamp.size },
+    { "inode", stamp.inode },
+    { "data", json },
+  };
+  std::vector<uint8_t> bytes = json_t::to_cbor(cache);
+  fs::path path_file_tmp = "{}.{}"_fmt(path_file_cache, getpid());
+  std::ofstream file_tmp(path_file_tmp, std::ios::binary | std::ios::trunc);
+  ereturn_if(not file_tmp.is_open(), "Could not open cache file '{}'"_fmt(path_file_tmp));
+  file_tmp.write(reinterpret_cast<char const*>(bytes.data()), bytes.size());
+  file_tmp.close();
+  fs::rename(path_file_tmp, path_file_cache, ec);
+  elog_if(ec, "Could not write cache file '{}': {}"_fmt(path_file_cache, ec.message()));
+} // Snapshot::write_cache() }}}
+
+// Snapshot::load() {{{
+// Returns null if the file does not exist, throws if it cannot be parsed
+inline std::shared_ptr<json_t const> Snapshot::load(fs::path const& path_file, Persist persist)
+{
+  struct stat st;
+  qreturn_if(::stat(path_file.c_str(), &st) < 0, nullptr);
+  Stamp stamp
+  {
+    .mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec,
+    .size = static_cast<int64_t>(st.st_size),
+    .inode = static_cast<uint64_t>(st.st_ino),
+  };
+
+  std::lock_guard lock(m_mutex);
+
+  // Parsed before by this process
+  if ( auto it = m_entries.find(path_file.string()); it != m_entries.end() and it->second.stamp == stamp )
+  {
+    return it->second.json;
+  } // if
+
+  // Parsed before by another process
+  std::optional<fs::path> opt_path_file_cache = (persist == Persist::Y)? path_file_cache(path_file) : std::nullopt;
+  std::shared_ptr<json_t const> json = (opt_path_file_cache)? read_cache(*opt_path_file_cache, path_file, stamp) : nullptr;
+
+  // Parse the text
+  if ( not json )
+  {
+    std::ifstream file(path_file, std::ios::in);
+    qreturn_if(not file.is_open(), nullptr);
+    json_t parsed = json_t::parse(file, nullptr, false);
+    ithrow_if(parsed.is_discarded(), "Failed to parse db '{}'"_fmt(path_file));
+    json = std::make_shared<json_t const>(std::move(parsed));
+    if ( opt_path_file_cache ) { write_cache(*opt_path_file_cache, path_file, stamp, *json); }
+  } // if
+
+  m_entries.insert_or_assign(path_file.string(), Entry{ .stamp = stamp, .json = json });
+  return json;
+} // Snapshot::load() }}}
+
+// Snapshot::evict() {{{
+inline void Snapshot::evict(fs::path const& path_file)
+{
+  std::lock_guard lock(m_mutex);
+  m_entries.erase(path_file.string());
+} // Snapshot::evict() }}}
+
 // class Db {{{
 class Db
 {
@@ -43,6 +306,8 @@ class Db
     std::variant<json_t, std::reference_wrapper<json_t>> m_json;
     fs::path m_path_file_db;
     Mode m_mode;
+    // Held by writers from the read until the file is replaced, also if the constructor throws
+    Lock m_lock;
 
     Db(std::reference_wrapper<json_t> json);
 
@@ -101,7 +366,7 @@ class Db
     Db operator=(Db const&) = delete;
     Db operator=(Db&&) = delete;
     template<ns_concept::StringRepresentable T>
-    Db const& operator[](T&& t) const;
+    Db operator[](T&& t) const;
     template<ns_concept::StringRepresentable T>
     Db operator()(T&& t);
     template<typename T>
@@ -119,10 +384,10 @@ inline Db::Db(std::string_view json_data)
   : m_path_file_db("/dev/null")
   , m_mode(Mode::READ)
 {
-  // Validate contents
-  ithrow_if(not json_t::accept(json_data), "Failed to parse json data: '{}'"_fmt(json_data));
-  // Parse contents
-  m_json = json_t::parse(json_data);
+  // Parse and validate contents in a single pass
+  json_t json = json_t::parse(json_data, nullptr, false);
+  ithrow_if(json.is_discarded(), "Failed to parse json data: '{}'"_fmt(json_data));
+  m_json = std::move(json);
 }
 
 inline Db::Db(fs::path t, Mode mode)
@@ -131,31 +396,25 @@ inline Db::Db(fs::path t, Mode mode)
 {
   ns_log::debug()("Open file '{}' as '{}'", m_path_file_db, mode);
 
-  auto f_parse_file = [](std::string const& name_file, std::ifstream const& f)
+  // Writers are serialized, readers do not take the lock since files are replaced atomically
+  if ( mode != Mode::READ )
   {
-    // Read to string
-    std::string contents = ns_string::to_string(f.rdbuf());
-    // Validate contents
-    ithrow_if(not json_t::accept(contents), "Failed to parse db '{}'"_fmt(name_file));
-    // Parse contents
-    return json_t::parse(contents);
-  };
+    auto expected_lock = lock(m_path_file_db);
+    elog_if(not expected_lock, expected_lock.error());
+    if ( expected_lock ) { m_lock = std::move(*expected_lock); }
+  } // if
 
   auto f_create = [&]
   {
     ns_log::debug()("Creating empty db file {}", t);
   };
 
+  // Copies the parsed file shared by the process
   auto f_read = [&] -> bool
   {
-    // Open target file as read
-    std::ifstream file(t, std::ios::in);
-    // Check for failure
-    if ( not file.good() ) { return false; } // if
-    // Try to parse
-    m_json = f_parse_file(t.string(), file);
-    // Close file
-    file.close();
+    auto json = Snapshot::get().load(t);
+    qreturn_if(not json, false);
+    m_json = *json;
     return true;
   };
 
@@ -180,12 +439,11 @@ inline Db::Db(fs::path t, Mode mode)
 
 inline Db::~Db()
 {
-  if ( m_mode != Mode::READ and std::holds_alternative<json_t>(m_json) )
+  if ( std::holds_alternative<json_t>(m_json) and m_mode != Mode::READ )
   {
-    std::ofstream file(m_path_file_db, std::ios::trunc);
-    ereturn_if(not file.is_open(), "Failed to open '{}' for writing"_fmt(m_path_file_db));
-    file << std::setw(2) << std::get<json_t>(m_json);
-    file.close();
+    auto expected_commit = commit(m_path_file_db, std::get<json_t>(m_json).dump(2));
+    elog_if(not expected_commit, "Failed to write '{}': {}"_fmt(m_path_file_db, expected_commit.error()));
+    Snapshot::get().evict(m_path_file_db);
   } // if
 } // Db
 
@@ -384,33 +642,21 @@ inline Db::operator std::string() const
 } // operator::string() }}}
 
 // operator[] {{{
-// Key exists and is accessed
+// Key exists and is accessed, the returned object refers to this one
 template<ns_concept::StringRepresentable T>
-Db const& Db::operator[](T&& t) const
+Db Db::operator[](T&& t) const
 {
   std::string key = ns_string::to_string(t);
-  static std::unique_ptr<Db> db;
-
   json_t& json = data();
 
   // Check if key is present
-  if ( ! json.contains(key) )
+  auto it = json.find(key);
+  if ( it == json.end() )
   {
     "Key '{}' not present in db file"_throw(key);
   } // if
 
-  // Access key
-  try
-  {
-    db = std::unique_ptr<Db>(new Db{std::reference_wrapper<json_t>(json[key])});
-  } // try
-  catch(std::exception const& e)
-  {
-    "Failed to parse key '{}': {}"_throw(key, e.what());
-  } // catch
-
-  // Unreachable, used to suppress no return warning
-  return *db;
+  return Db{std::reference_wrapper<json_t>(*it)};
 } // operator[] }}}
 
 // operator() {{{
@@ -445,6 +691,29 @@ decltype(auto) Db::operator=(T&& t)
   return json;
 } // operator=(ns_concept::StringRepresentable) }}}
 
+// clean() {{{
+// Removes the temporary files left in 'path_dir' by writers that exited before replacing their file,
+// e.g., before the directory is packed into a layer
+inline void clean(fs::path const& path_dir)
+{
+  std::error_code ec;
+  for (auto it = fs::directory_iterator(path_dir, ec); not ec and it != fs::directory_iterator(); it.increment(ec))
+  {
+    // Temporary files are named '.<name>.<pid>.tmp'
+    std::string name = it->path().filename().string();
+    qcontinue_if(not name.starts_with('.') or not name.ends_with(".tmp"));
+    std::string str_pid = fs::path(name).stem().extension().string();
+    pid_t pid;
+    auto [ptr, ec_pid] = std::from_chars(str_pid.data() + std::min<size_t>(str_pid.size(), 1), str_pid.data() + str_pid.size(), pid);
+    qcontinue_if(ec_pid != std::errc{} or ptr != str_pid.data() + str_pid.size());
+    // The writer is still running
+    qcontinue_if(kill(pid, 0) == 0 or errno != ESRCH);
+    ns_log::debug()("Remove stale temporary file '{}'", it->path());
+    std::error_code ec_remove;
+    fs::remove(it->path(), ec_remove);
+  } // for
+} // clean() }}}
+
 // from_file() {{{
 template<ns_concept::StringRepresentable T, typename F>
 void from_file(T&& t, F&& f, Mode mode)
@@ -455,32 +724,29 @@ void from_file(T&& t, F&& f, Mode mode)
   f(db);
 } // function: from_file }}}
 
+// query_impl() {{{
+inline std::string query_impl(Db const& db)
+{
+  return db;
+} // query_impl() }}}
+
+// query_impl() {{{
+// Each access refers to the previous one, which lives until the end of the full expression
+template<typename T, typename... U>
+inline std::string query_impl(Db const& db, T&& t, U&&... u)
+{
+  return query_impl(db[std::forward<T>(t)], std::forward<U>(u)...);
+} // query_impl() }}}
+
 // query() {{{
 template<typename F, typename... Args>
 inline std::string query(F&& file, Args... args)
 {
   std::string ret;
 
-  auto f_access_impl = [&]<typename T, typename U>(T& ref_db, U&& u)
-  {
-    ref_db = std::reference_wrapper(ref_db.get()[u]);
-  }; // f_access
-
-  auto f_access = [&]<typename T, typename... U>(T& ref_db, U&&... u)
-  {
-    ( f_access_impl(ref_db, std::forward<U>(u)), ... );
-  }; // f_access
-
   from_file(file, [&]<typename T>(T&& db)
   {
-    // Get a ref to db
-    auto ref_db = std::reference_wrapper<Db const>(db);
-
-    // Update the ref to the selected query object
-    f_access(ref_db, std::forward<Args>(args)...);
-
-    // Assign result
-    ret = ref_db.get();
+    ret = query_impl(db, args...);
   }, Mode::READ);
 
   return ret;
@@ -493,6 +759,22 @@ template<typename F, typename... Args>
   return ns_exception::to_expected([&]{ return query(std::forward<F>(file), std::forward<Args>(args)...); });
 } // query_nothrow() }}}
 
+// get() {{{
+// Typed lookup of a key path in the parsed file shared by the process, the document is not copied.
+// The parsed file is persisted for the next processes
+template<typename T, typename... Keys>
+[[nodiscard]] std::expected<T,std::string> get(fs::path const& path_file, Keys&&... keys)
+{
+  return ns_exception::to_expected([&]
+  {
+    auto json = Snapshot::get().load(path_file, Persist::Y);
+    if ( not json ) { "Could not read file '{}'"_throw(path_file); }
+    json_t const* ptr = json.get();
+    ( (ptr = &ptr->at(keys)), ... );
+    return ptr->get<T>();
+  });
+} // get() }}}
+
 } // namespace ns_db
 
 /* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <filesystem>
+#include <fstream>
 #include "log.hpp"
 #include "fuse.hpp"
 #include "subprocess.hpp"
@@ -60,7 +61,10 @@ class Dwarfs
         .with_die_on_pid(pid_to_die_for)
         .spawn();
       // Wait for mount
-      ns_fuse::wait_fuse(path_dir_mount);
+      auto expected_mount = ns_fuse::wait_fuse(path_dir_mount, m_subprocess->get_pidfd());
+      // Stop the helper on failure, it runs in the foreground and would keep its destructor waiting
+      if ( not expected_mount ) { m_subprocess->kill(SIGTERM); }
+      ethrow_if(not expected_mount, expected_mount.error());
     } // Dwarfs
     
     ~Dwarfs()
@@ -68,10 +72,7 @@ class Dwarfs
       // Un-mount
       ns_fuse::unmount(m_path_dir_mountpoint);
       // Tell process to exit with SIGTERM
-      if ( auto opt_pid = m_subprocess->get_pid() )
-      {
-        kill(*opt_pid, SIGTERM);
-      } // if
+      m_subprocess->kill(SIGTERM);
       // Wait for process to exit
       auto ret = m_subprocess->wait();
       dreturn_if(not ret, "Mount '{}' exited unexpectedly"_fmt(m_path_dir_mountpoint));
@@ -102,6 +103,44 @@ inline bool is_dwarfs(fs::path const& path_file_dwarfs, uint64_t offset = 0)
   return std::ranges::equal(header, std::string_view("DWARFS"));
 } // is_dwarfs() }}}
 
+// struct Layer {{{
+struct Layer
+{
+  fs::path path_file;
+  uint64_t offset;
+  uint64_t size;
+}; // }}}
+
+// get_layers() {{{
+// Walks the chain of size-prefixed dwarfs filesystems in 'path_file_binary' starting at 'offset'
+inline std::vector<Layer> get_layers(fs::path const& path_file_binary, uint64_t offset)
+{
+  std::vector<Layer> vec_layers;
+  // Open the main binary
+  std::ifstream file_binary(path_file_binary, std::ios::binary);
+  ereturn_if(not file_binary.is_open(), "Could not open file '{}'"_fmt(path_file_binary), vec_layers);
+  // Advance offset
+  file_binary.seekg(offset);
+  // Read filesystems concatenated in the image itself
+  while (true)
+  {
+    // Read filesystem size
+    int64_t size_fs;
+    dbreak_if(not file_binary.read(reinterpret_cast<char*>(&size_fs), sizeof(size_fs)), "Stopped reading at index {}"_fmt(vec_layers.size()));
+    ns_log::debug()("Filesystem size is '{}'", size_fs);
+    // Skip size bytes
+    offset += 8;
+    // Check if filesystem is of type 'DWARFS'
+    ebreak_if(not is_dwarfs(path_file_binary, offset), "Invalid dwarfs filesystem appended on the image");
+    // Include layer
+    vec_layers.push_back(Layer{ .path_file = path_file_binary, .offset = offset, .size = static_cast<uint64_t>(size_fs) });
+    // Go to next filesystem if exists
+    offset += size_fs;
+    file_binary.seekg(offset);
+  } // while
+  return vec_layers;
+} // get_layers() }}}
+
 
 } // namespace ns_dwarfs
 
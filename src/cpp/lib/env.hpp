@@ -7,7 +7,10 @@
 
 #include <filesystem>
 #include <cstdlib>
-#include <wordexp.h>
+#include <expected>
+#include <optional>
+#include <unordered_map>
+#include <unistd.h>
 
 #include "../std/string.hpp"
 #include "../common.hpp"
@@ -177,39 +180,204 @@ inline bool exists(const char* var, std::string_view target)
   return std::string_view{value} == target;
 } // exists() }}}
 
-// expand() {{{
-inline std::expected<std::string, std::string> expand(ns_concept::StringRepresentable auto&& var)
+// class Snapshot {{{
+// Copy of the environment indexed by name, lookups do not go through getenv
+class Snapshot
+{
+  private:
+    std::vector<std::string> m_entries;
+    std::unordered_map<std::string_view,std::string_view> m_index;
+  public:
+    Snapshot();
+    // The index points into the entries
+    Snapshot(Snapshot const&) = delete;
+    Snapshot& operator=(Snapshot const&) = delete;
+    std::optional<std::string_view> get(std::string_view name) const;
+}; // class Snapshot }}}
+
+// Snapshot::Snapshot() {{{
+inline Snapshot::Snapshot()
+{
+  for (char** i = environ; *i != nullptr; ++i) { m_entries.emplace_back(*i); }
+  m_index.reserve(m_entries.size());
+  for (std::string_view entry : m_entries)
+  {
+    size_t pos = entry.find('=');
+    qcontinue_if(pos == std::string_view::npos);
+    // Keeps the first definition, like getenv
+    m_index.emplace(entry.substr(0, pos), entry.substr(pos + 1));
+  } // for
+} // Snapshot::Snapshot() }}}
+
+// Snapshot::get() {{{
+inline std::optional<std::string_view> Snapshot::get(std::string_view name) const
+{
+  auto it = m_index.find(name);
+  qreturn_if(it == m_index.end(), std::nullopt);
+  return it->second;
+} // Snapshot::get() }}}
+
+namespace
+{
+
+// is_name() {{{
+constexpr bool is_name(char c, bool is_first)
+{
+  return c == '_'
+    or (c >= 'a' and c <= 'z')
+    or (c >= 'A' and c <= 'Z')
+    or (not is_first and c >= '0' and c <= '9');
+} // is_name() }}}
+
+// is_expandable() {{{
+constexpr bool is_expandable(std::string_view str)
 {
-  std::string expanded = ns_string::to_string(var);
+  return str.find_first_of("$~") != std::string_view::npos;
+} // is_expandable() }}}
 
-  // Perform word expansion
-  wordexp_t data;
-  if (int ret = wordexp(expanded.c_str(), &data, 0); ret == 0)
+// find_quoted() {{{
+// Position of the value of 'KEY=VALUE', or of the whole string without a '=', when one pair of
+// matching quotes surrounds it
+constexpr std::optional<size_t> find_quoted(std::string_view str)
+{
+  size_t pos = str.find('=');
+  pos = (pos == std::string_view::npos)? 0 : pos + 1;
+  std::string_view value = str.substr(pos);
+  qreturn_if(value.size() < 2 or value.front() != value.back(), std::nullopt);
+  qreturn_if(value.front() != '"' and value.front() != '\'', std::nullopt);
+  return pos;
+} // find_quoted() }}}
+
+// expand_into() {{{
+// Appends the expansion of 'str' to 'out', 'f_get' looks up a variable by name
+template<typename F>
+std::expected<void,std::string> expand_into(std::string_view str, F&& f_get, std::string& out)
+{
+  for (size_t i = 0; i < str.size();)
   {
-    if (data.we_wordc > 0)
+    char c = str[i];
+    // Escaped dollar sign
+    if ( c == '\\' and i + 1 < str.size() and str[i+1] == '$' )
     {
-      expanded = data.we_wordv[0];
+      out.push_back('$');
+      i += 2;
     } // if
-    wordfree(&data);
+    // Home directory at the start of a path
+    else if ( c == '~'
+      and (i == 0 or str[i-1] == '=' or str[i-1] == ':')
+      and (i + 1 == str.size() or str[i+1] == '/' or str[i+1] == ':') )
+    {
+      out.append(f_get("HOME").value_or("~"));
+      i += 1;
+    } // else if
+    // $VAR
+    else if ( c == '$' and i + 1 < str.size() and is_name(str[i+1], true) )
+    {
+      size_t end = i + 2;
+      while ( end < str.size() and is_name(str[end], false) ) { ++end; }
+      out.append(f_get(str.substr(i + 1, end - i - 1)).value_or(""));
+      i = end;
+    } // else if
+    // ${VAR} and ${VAR:-default}, the default may contain expansions
+    else if ( c == '$' and i + 1 < str.size() and str[i+1] == '{' )
+    {
+      size_t depth = 1;
+      size_t end = i + 2;
+      for (; end < str.size() and depth > 0; ++end)
+      {
+        if ( str[end] == '{' ) { ++depth; }
+        else if ( str[end] == '}' ) { --depth; }
+      } // for
+      qreturn_if(depth > 0, std::unexpected("Unterminated '${{' in '{}'"_fmt(str)));
+      std::string_view body = str.substr(i + 2, end - i - 3);
+      size_t size_name = 0;
+      while ( size_name < body.size() and is_name(body[size_name], size_name == 0) ) { ++size_name; }
+      std::string_view name = body.substr(0, size_name);
+      std::string_view op = body.substr(size_name);
+      qreturn_if(name.empty() or (not op.empty() and not op.starts_with(":-"))
+        , std::unexpected("Unsupported expansion '${{{}}}'"_fmt(body))
+      );
+      if ( auto value = f_get(name); value and not value->empty() )
+      {
+        out.append(*value);
+      } // if
+      else if ( not op.empty() )
+      {
+        auto expected_default = expand_into(op.substr(2), f_get, out);
+        qreturn_if(not expected_default, expected_default);
+      } // else if
+      i = end;
+    } // else if
+    // Anything else is literal
+    else
+    {
+      out.push_back(c);
+      i += 1;
+    } // else
+  } // for
+  return {};
+} // expand_into() }}}
+
+// expand_unquoted() {{{
+// Drops the quotes around the value like the shell, the value is kept literal in single quotes
+template<typename F>
+std::expected<std::string, std::string> expand_unquoted(std::string_view str, F&& f_get)
+{
+  std::string unquoted;
+  if ( auto opt_pos = find_quoted(str) )
+  {
+    unquoted = std::string{str.substr(0, *opt_pos)}.append(str.substr(*opt_pos + 1, str.size() - *opt_pos - 2));
+    qreturn_if(str[*opt_pos] == '\'', unquoted);
+    str = unquoted;
   } // if
-  else
+  qreturn_if(not is_expandable(str), std::string{str});
+  std::string expanded;
+  auto expected = expand_into(str, f_get, expanded);
+  qreturn_if(not expected, std::unexpected(expected.error()));
+  return expanded;
+} // expand_unquoted() }}}
+
+} // namespace
+
+// expand() {{{
+// Expands $VAR, ${VAR}, ${VAR:-default} and ~ at the start of a path, undefined variables expand
+// to nothing and commands are never run. One pair of quotes around the value of 'KEY=VALUE', or
+// around the whole string, is removed first
+inline std::expected<std::string, std::string> expand(ns_concept::StringRepresentable auto&& var)
+{
+  std::string str = ns_string::to_string(var);
+  qreturn_if(not is_expandable(str) and not find_quoted(str), str);
+  return expand_unquoted(str, [](std::string_view name) -> std::optional<std::string_view>
   {
-    std::string error;
-    switch(ret)
-    {
-      case WRDE_BADCHAR: error = "WRDE_BADCHAR"; break;
-      case WRDE_BADVAL: error = "WRDE_BADVAL"; break;
-      case WRDE_CMDSUB: error = "WRDE_CMDSUB"; break;
-      case WRDE_NOSPACE: error = "WRDE_NOSPACE"; break;
-      case WRDE_SYNTAX: error = "WRDE_SYNTAX"; break;
-      default: error = "unknown";
-    } // switch
-    return std::unexpected(error);
-  } // else
+    const char* value = std::getenv(std::string{name}.c_str());
+    return (value)? std::make_optional<std::string_view>(value) : std::nullopt;
+  });
+} // expand() }}}
 
-  return expanded;
+// expand() {{{
+// Same as expand(), looks up variables in the snapshot
+inline std::expected<std::string, std::string> expand(std::string_view str, Snapshot const& snapshot)
+{
+  return expand_unquoted(str, [&](std::string_view name){ return snapshot.get(name); });
 } // expand() }}}
 
+// expand_all() {{{
+// Expands each string in place, strings without expansions or quotes are not touched and strings
+// that fail to expand are kept. Returns the errors
+template<std::ranges::range R>
+std::vector<std::string> expand_all(R& entries, Snapshot const& snapshot)
+{
+  std::vector<std::string> errors;
+  for (std::string& entry : entries)
+  {
+    qcontinue_if(not is_expandable(entry) and not find_quoted(entry));
+    auto expected = expand(entry, snapshot);
+    if ( expected ) { entry = std::move(*expected); }
+    else { errors.push_back(expected.error()); }
+  } // for
+  return errors;
+} // expand_all() }}}
+
 // xdg_data_home() {{{
 template<typename T = std::string_view>
 std::optional<T> xdg_data_home()
@@ -221,6 +389,17 @@ std::optional<T> xdg_data_home()
   return std::make_optional(std::string{home} + "/.local/share");
 } // xdg_data_home() }}}
 
+// xdg_cache_home() {{{
+template<typename T = std::string_view>
+std::optional<T> xdg_cache_home()
+{
+  const char* var = std::getenv("XDG_CACHE_HOME");
+  qreturn_if(var, std::make_optional(var));
+  const char* home = std::getenv("HOME");
+  qreturn_if(not home, std::nullopt);
+  return std::make_optional(std::string{home} + "/.cache");
+} // xdg_cache_home() }}}
+
 } // namespace ns_env }}}
 
 /* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
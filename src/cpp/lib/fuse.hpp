@@ -12,6 +12,7 @@
 #include <sys/mount.h>
 #include <thread>
 
+#include "pidfd.hpp"
 #include "subprocess.hpp"
 
 // Other codes available here:
@@ -41,18 +42,32 @@ inline std::expected<bool,std::string> is_fuse(fs::path const& path_dir_mount)
   return buf.f_type == FUSE_SUPER_MAGIC;
 } // function: mountpoint
 
-inline void wait_fuse(fs::path const& path_dir_filesystem)
+// Waits for the filesystem to be mounted, fails early if the helper process referred to by
+// 'opt_pidfd' exits before mounting it
+inline std::expected<void,std::string> wait_fuse(fs::path const& path_dir_filesystem
+  , std::optional<int> opt_pidfd = std::nullopt)
 {
   using namespace std::chrono_literals;
   auto time_beg = std::chrono::system_clock::now();
   while ( true )
   {
     auto expected_is_fuse = ns_fuse::is_fuse(path_dir_filesystem);
-    ebreak_if(not expected_is_fuse, "Could not check if filesystem is fuse");
-    dbreak_if( *expected_is_fuse, "Filesystem '{}' is fuse"_fmt(path_dir_filesystem));
+    qreturn_if(not expected_is_fuse, std::unexpected("Could not check if filesystem is fuse: {}"_fmt(expected_is_fuse.error())));
+    dreturn_if( *expected_is_fuse, "Filesystem '{}' is fuse"_fmt(path_dir_filesystem), {});
+    // Pause between checks, the exit of the helper ends the pause early
+    if ( opt_pidfd )
+    {
+      qreturn_if(ns_pidfd::wait(*opt_pidfd, 10ms)
+        , std::unexpected("Helper process exited before mounting '{}'"_fmt(path_dir_filesystem))
+      );
+    } // if
+    else
+    {
+      std::this_thread::sleep_for(10ms);
+    } // else
     auto time_cur = std::chrono::system_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(time_cur - time_beg);
-    ebreak_if(elapsed.count() > 60, "Reached timeout to wait for fuse filesystems");
+    qreturn_if(elapsed.count() > 60, std::unexpected("Reached timeout to wait for fuse filesystem '{}'"_fmt(path_dir_filesystem)));
   } // while
 } // function: wait_fuse
 
@@ -3,9 +3,17 @@
 // @file        : ipc
 ///
 
+#pragma once
+
+#include <algorithm>
 #include <filesystem>
-#include <sys/ipc.h>
-#include <sys/msg.h>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include <cstring>
 
 #include "../common.hpp"
@@ -13,158 +21,255 @@
 #include "../std/string.hpp"
 #include "log.hpp"
 
+// Messages travel through a unix domain stream socket as [8 bytes size][data], file descriptors
+// are attached to the size header with SCM_RIGHTS
+
 namespace ns_ipc
 {
 
 namespace fs = std::filesystem;
 
-struct message_buffer
+// Maximum number of file descriptors attached to a single message
+constexpr size_t const MAX_FDS = 8;
+
+struct Message
 {
-  long message_type;
-  char message_text[2048];
+  std::string data;
+  std::vector<int> fds;
 };
 
 // class Ipc {{{
 class Ipc
 {
   private:
-    key_t m_key;
-    int m_message_queue_id;
-    message_buffer m_buffer;
-    bool m_is_guest;
+    int m_fd;
+    // Only set for the listening socket, which removes the socket file on destruction
+    std::optional<fs::path> m_opt_path_file_socket;
+    Ipc(int fd, std::optional<fs::path> opt_path_file_socket);
   public:
     // Constructors
-    Ipc(key_t key, int message_queue_id, message_buffer buffer, bool is_guest)
-      : m_key(key)
-      , m_message_queue_id(message_queue_id)
-      , m_buffer(buffer)
-      , m_is_guest(is_guest)
-    {}
+    Ipc(Ipc const&) = delete;
+    Ipc(Ipc&& other);
+    Ipc& operator=(Ipc const&) = delete;
+    Ipc& operator=(Ipc&&) = delete;
     ~Ipc();
     // Factory methods
-    static Ipc guest(fs::path path_file);
-    static Ipc host(fs::path path_file);
+    static Ipc guest(fs::path const& path_file_socket);
+    static Ipc host(fs::path const& path_file_socket);
+    static Ipc adopt(int fd);
+    // Connection
+    std::optional<Ipc> accept();
+    int fd() const;
     // Send/Recv Operations
     template<ns_concept::StringRepresentable T>
-    void send(T&& t);
-    std::optional<std::string> recv();
-
+    bool send(T&& t, std::vector<int> const& fds = {});
+    std::optional<Message> recv();
 }; // class Ipc }}}
 
+// Ipc::Ipc() {{{
+inline Ipc::Ipc(int fd, std::optional<fs::path> opt_path_file_socket)
+  : m_fd(fd)
+  , m_opt_path_file_socket(opt_path_file_socket)
+{
+} // Ipc::Ipc() }}}
+
+// Ipc::Ipc() {{{
+inline Ipc::Ipc(Ipc&& other)
+  : m_fd(std::exchange(other.m_fd, -1))
+  , m_opt_path_file_socket(std::exchange(other.m_opt_path_file_socket, std::nullopt))
+{
+} // Ipc::Ipc() }}}
+
+// Ipc::~Ipc() {{{
+inline Ipc::~Ipc()
+{
+  if ( m_fd >= 0 ) { close(m_fd); }
+  // Not managed by guest
+  if ( m_opt_path_file_socket ) { unlink(m_opt_path_file_socket->c_str()); }
+} // Ipc::~Ipc() }}}
+
 // Ipc::guest() {{{
-inline Ipc Ipc::guest(fs::path path_file)
+inline Ipc Ipc::guest(fs::path const& path_file_socket)
 {
-  std::string identifier = ns_string::to_string(fs::canonical(path_file));
-  ns_log::info()("key identifier: {}", identifier);
+  ns_log::debug()("Connect to socket: {}", path_file_socket);
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if ( path_file_socket.string().size() >= sizeof(addr.sun_path) )
+  {
+    "Socket path '{}' is too long"_throw(path_file_socket);
+  } // if
+  std::strncpy(addr.sun_path, path_file_socket.c_str(), sizeof(addr.sun_path) - 1);
 
-  // Use a unique key for the message queue.
-  key_t key;
-  if(key = ftok(identifier.c_str(), 65); key == -1 )
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( fd < 0 )
   {
-    perror("Could not generate token for message queue");
-    "Could not generate key for message queue with identifier '{}': {}"_throw(identifier, strerror(errno));
+    "Could not create socket: {}"_throw(strerror(errno));
   } // if
-  ns_log::info()("Generated message_queue key: {}", key);
 
-  // Connect to the message queue
-  int message_queue_id = -1;
-  if (message_queue_id = msgget(key, 0666); message_queue_id == -1 )
+  if ( connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 )
   {
-    perror("Could not create message queue");
-    "msgget failed, could not create message queue for identifier '{}': {}"_throw(identifier, strerror(errno));
+    int err = errno;
+    close(fd);
+    "Could not connect to socket '{}': {}"_throw(path_file_socket, strerror(err));
   } // if
-  ns_log::info()("Message queue id: {}", message_queue_id);
 
-  return Ipc(key, message_queue_id, message_buffer{.message_type=1, .message_text=""}, true);
+  return Ipc(fd, std::nullopt);
 } // Ipc::guest() }}}
 
 // Ipc::host() {{{
-inline Ipc Ipc::host(fs::path path_file)
+inline Ipc Ipc::host(fs::path const& path_file_socket)
 {
-  std::string identifier = ns_string::to_string(fs::canonical(path_file));
-  ns_log::info()("key identifier: {}", identifier);
+  ns_log::debug()("Listen on socket: {}", path_file_socket);
 
-  // Use a unique key for the message queue.
-  key_t key;
-  if(key = ftok(identifier.c_str(), 65); key == -1 )
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if ( path_file_socket.string().size() >= sizeof(addr.sun_path) )
   {
-    perror("Could not generate token for message queue");
-    "Could not generate key for message queue with identifier '{}': {}"_throw(identifier, strerror(errno));
+    "Socket path '{}' is too long"_throw(path_file_socket);
   } // if
-  ns_log::info()("Generated message_queue key: {}", key);
+  std::strncpy(addr.sun_path, path_file_socket.c_str(), sizeof(addr.sun_path) - 1);
+
+  // Remove stale socket
+  unlink(path_file_socket.c_str());
 
-  // Close existing queue
-  if ( int message_queue_id = msgget(key, 0666); message_queue_id != -1 and msgctl(message_queue_id, IPC_RMID, NULL) == -1)
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( fd < 0 )
   {
-    ns_log::error()("Could not remove existing message queue");
-    perror("Could not remove existing message queue");
+    "Could not create socket: {}"_throw(strerror(errno));
   } // if
-  else
-  {
-    ns_log::info()("Closed existing message queue");
-  } // else
 
-  // Connect to the message queue
-  int message_queue_id = -1;
-  if (message_queue_id = msgget(key, 0666 | IPC_CREAT); message_queue_id == -1 )
+  if ( bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 or listen(fd, SOMAXCONN) < 0 )
   {
-    perror("Could not create message queue");
-    "msgget failed, could not create message queue for identifier '{}': {}"_throw(identifier, strerror(errno));
+    int err = errno;
+    close(fd);
+    "Could not listen on socket '{}': {}"_throw(path_file_socket, strerror(err));
   } // if
-  ns_log::info()("Message queue id: {}", message_queue_id);
 
-  return Ipc(key, message_queue_id, message_buffer{.message_type=1, .message_text=""}, false);
+  return Ipc(fd, path_file_socket);
 } // Ipc::host() }}}
 
-// Ipc::~Ipc() {{{
-inline Ipc::~Ipc()
+// Ipc::adopt() {{{
+// Takes ownership of a listening socket inherited from another process, which keeps ownership of
+// the socket file
+inline Ipc Ipc::adopt(int fd)
 {
-  // No managed by guest
-  if ( m_is_guest ) { return; } // if
+  ns_log::debug()("Adopt listening socket: {}", fd);
 
-  // Close
-  if ( msgctl(m_message_queue_id, IPC_RMID, NULL) == -1 )
+  int type;
+  socklen_t size_type = sizeof(type);
+  if ( getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &size_type) < 0 or type != SOCK_STREAM )
   {
-    ns_log::error()("Could not remove the message queue");
-    perror("Could not remove message queue");
+    "File descriptor '{}' is not a stream socket"_throw(fd);
   } // if
-} // Ipc::~Ipc() }}}
+
+  // Do not leak into the children of the adopting process
+  if ( fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 )
+  {
+    "Could not set close-on-exec on '{}': {}"_throw(fd, strerror(errno));
+  } // if
+
+  return Ipc(fd, std::nullopt);
+} // Ipc::adopt() }}}
+
+// Ipc::accept() {{{
+inline std::optional<Ipc> Ipc::accept()
+{
+  int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if ( fd < 0 )
+  {
+    ns_log::debug()("Failed to accept connection: {}", strerror(errno));
+    return std::nullopt;
+  } // if
+  return Ipc(fd, std::nullopt);
+} // Ipc::accept() }}}
+
+// Ipc::fd() {{{
+inline int Ipc::fd() const
+{
+  return m_fd;
+} // Ipc::fd() }}}
 
 // Ipc::send() {{{
 template<ns_concept::StringRepresentable T>
-void Ipc::send(T&& t)
+bool Ipc::send(T&& t, std::vector<int> const& fds)
 {
   std::string data = ns_string::to_string(t);
-  ns_log::info()("Sending message '{}'", data);
-  // Copy the contents of std::string to the message_text buffer
-  strncpy(m_buffer.message_text, data.c_str(), sizeof(m_buffer.message_text));
-  // Ensure null termination
-  m_buffer.message_text[sizeof(m_buffer.message_text) - 1] = '\0';
-  // Send message
-  if ( msgsnd(m_message_queue_id, &m_buffer, sizeof(m_buffer), 0) == -1 )
+  ns_log::debug()("Sending message '{}'", data);
+  ereturn_if(fds.size() > MAX_FDS, "Too many file descriptors in message", false);
+
+  // Size header, carries the file descriptors
+  uint64_t size = data.size();
+  iovec iov{ .iov_base = &size, .iov_len = sizeof(size) };
+  alignas(cmsghdr) char buffer_control[CMSG_SPACE(sizeof(int) * MAX_FDS)]{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if ( not fds.empty() )
   {
-    perror("Failure to send message");
+    msg.msg_control = buffer_control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
   } // if
+  ssize_t bytes = sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+  ereturn_if(bytes != sizeof(size), "Failure to send message header: {}"_fmt(strerror(errno)), false);
+
+  // Payload
+  for (size_t offset = 0; offset < data.size();)
+  {
+    bytes = ::send(m_fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+    ereturn_if(bytes <= 0, "Failure to send message: {}"_fmt(strerror(errno)), false);
+    offset += bytes;
+  } // for
+
+  return true;
 } // Ipc::send() }}}
 
 // Ipc::recv() {{{
-inline std::optional<std::string> Ipc::recv()
+// Received file descriptors are owned by the caller and have close-on-exec set
+inline std::optional<Message> Ipc::recv()
 {
-  int length = msgrcv(m_message_queue_id, &m_buffer, sizeof(m_buffer.message_text), 0, MSG_NOERROR);
+  Message message;
 
-  // Read message
-  if (length == -1)
+  // Size header, carries the file descriptors
+  uint64_t size;
+  iovec iov{ .iov_base = &size, .iov_len = sizeof(size) };
+  alignas(cmsghdr) char buffer_control[CMSG_SPACE(sizeof(int) * MAX_FDS)]{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buffer_control;
+  msg.msg_controllen = sizeof(buffer_control);
+  ssize_t bytes = recvmsg(m_fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  dreturn_if(bytes == 0, "Connection closed by peer", std::nullopt);
+  ereturn_if(bytes != sizeof(size), "Failed to receive message: {}"_fmt(strerror(errno)), std::nullopt);
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
   {
-    perror("Failure to receive message");
-    ns_log::error()("Failed to receive message: {}", strerror(errno));
-    return std::nullopt;
-  } // if
+    if ( cmsg->cmsg_level != SOL_SOCKET or cmsg->cmsg_type != SCM_RIGHTS ) { continue; }
+    size_t count_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    message.fds.resize(count_fds);
+    std::memcpy(message.fds.data(), CMSG_DATA(cmsg), sizeof(int) * count_fds);
+  } // for
 
-  // Ensure null termination
-  m_buffer.message_text[sizeof(m_buffer.message_text) - 1] = '\0';
+  // Payload
+  message.data.resize(size);
+  for (size_t offset = 0; offset < size;)
+  {
+    bytes = ::recv(m_fd, message.data.data() + offset, size - offset, 0);
+    if ( bytes <= 0 )
+    {
+      ns_log::error()("Failed to receive message: {}", strerror(errno));
+      std::ranges::for_each(message.fds, [](int fd){ close(fd); });
+      return std::nullopt;
+    } // if
+    offset += bytes;
+  } // for
 
-  // Convert message text to std::string
-  return std::make_optional(m_buffer.message_text);
+  return message;
 } // Ipc::recv() }}}
 
 } // namespace ns_ipc
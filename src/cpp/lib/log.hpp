@@ -7,6 +7,7 @@
 
 #include <filesystem>
 #include <fstream>
+#include <mutex>
 
 #include "../common.hpp"
 #include "../std/concept.hpp"
@@ -35,6 +36,7 @@ class Logger
   private:
     std::optional<std::ofstream> m_opt_os;
     Level m_level;
+    std::mutex m_mutex;
   public:
     Logger();
     Logger(Logger const&) = delete;
@@ -45,6 +47,7 @@ class Logger
     Level get_level() const;
     void set_sink_file(fs::path path_file_sink);
     std::optional<std::ofstream>& get_sink_file();
+    [[nodiscard]] std::unique_lock<std::mutex> lock();
 }; // class Logger }}}
 
 // fn: Logger::Logger {{{
@@ -63,6 +66,7 @@ inline void Logger::set_sink_file(fs::path path_file_sink)
   } // if
 
   // File output stream
+  std::lock_guard lock(m_mutex);
   m_opt_os = std::ofstream{path_file_sink};
 
   if( m_opt_os->bad() ) { std::runtime_error("Could not open file '{}'"_fmt(path_file_sink)); };
@@ -74,6 +78,13 @@ inline std::optional<std::ofstream>& Logger::get_sink_file()
   return m_opt_os;
 } // fn: Logger::get_sink_file }}}
 
+// fn: Logger::lock {{{
+// Serializes the writes of threads that log concurrently, e.g., the reader of subprocess outputs
+inline std::unique_lock<std::mutex> Logger::lock()
+{
+  return std::unique_lock(m_mutex);
+} // fn: Logger::lock }}}
+
 // fn: Logger::set_level {{{
 inline void Logger::set_level(Level level)
 {
@@ -142,6 +153,7 @@ class info
     requires ( ( ns_concept::StringRepresentable<Args> or ns_concept::IterableConst<Args> ) and ... )
     void operator()(T&& format, Args&&... args)
     {
+      auto lock = logger.lock();
       auto& opt_ostream_sink = logger.get_sink_file();
       print_if(opt_ostream_sink, *opt_ostream_sink, "I::{}::{}\n"_fmt(m_loc.get(), format), args...);
       print_if((logger.get_level() >= Level::INFO), std::cout, "I::{}::{}\n"_fmt(m_loc.get(), format), std::forward<Args>(args)...);
@@ -160,6 +172,7 @@ class error
     requires ( ( ns_concept::StringRepresentable<Args> or ns_concept::IterableConst<Args> ) and ... )
     void operator()(T&& format, Args&&... args)
     {
+      auto lock = logger.lock();
       auto& opt_ostream_sink = logger.get_sink_file();
       print_if(opt_ostream_sink, *opt_ostream_sink, "E::{}::{}\n"_fmt(m_loc.get(), format), args...);
       print_if((logger.get_level() >= Level::ERROR), std::cerr, "E::{}::{}\n"_fmt(m_loc.get(), format), std::forward<Args>(args)...);
@@ -178,6 +191,7 @@ class debug
     requires ( ( ns_concept::StringRepresentable<Args> or ns_concept::IterableConst<Args> ) and ... )
     void operator()(T&& format, Args&&... args)
     {
+      auto lock = logger.lock();
       auto& opt_ostream_sink = logger.get_sink_file();
       print_if(opt_ostream_sink, *opt_ostream_sink, "D::{}::{}\n"_fmt(m_loc.get(), format), args...);
       print_if((logger.get_level() >= Level::DEBUG), std::cerr, "D::{}::{}\n"_fmt(m_loc.get(), format), std::forward<Args>(args)...);
@@ -0,0 +1,80 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : pidfd
+///
+
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <expected>
+#include <optional>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../common.hpp"
+#include "../macro.hpp"
+#include "log.hpp"
+
+// Process file descriptors refer to a process instead of its pid, which the kernel may reuse after
+// the process is reaped. They become readable once the process exits, so they fit in poll loops.
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+namespace ns_pidfd
+{
+
+// P_PIDFD, missing from the idtype_t of older C libraries
+constexpr idtype_t const IDTYPE_PIDFD = static_cast<idtype_t>(3);
+
+// fn: open() {{{
+// The descriptor has close-on-exec set
+inline std::expected<int,std::string> open(pid_t pid)
+{
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  qreturn_if(fd < 0, std::unexpected("pidfd_open({}): {}"_fmt(pid, strerror(errno))));
+  return fd;
+} // fn: open() }}}
+
+// fn: send_signal() {{{
+inline bool send_signal(int pidfd, int signal)
+{
+  return syscall(SYS_pidfd_send_signal, pidfd, signal, nullptr, 0) == 0;
+} // fn: send_signal() }}}
+
+// fn: wait() {{{
+// Waits for the process to exit without reaping it, returns false on timeout
+inline bool wait(int pidfd, std::optional<std::chrono::milliseconds> opt_timeout = std::nullopt)
+{
+  pollfd fd{ .fd = pidfd, .events = POLLIN, .revents = 0 };
+  int ret;
+  while ( (ret = poll(&fd, 1, (opt_timeout)? opt_timeout->count() : -1)) < 0 and errno == EINTR ) {}
+  return ret > 0;
+} // fn: wait() }}}
+
+// fn: reap() {{{
+// Waits for the child to exit and reaps it, fails on kernels older than 5.4
+inline std::expected<siginfo_t,std::string> reap(int pidfd)
+{
+  siginfo_t info{};
+  int ret;
+  while ( (ret = waitid(IDTYPE_PIDFD, pidfd, &info, WEXITED)) < 0 and errno == EINTR ) {}
+  qreturn_if(ret < 0, std::unexpected("waitid(P_PIDFD): {}"_fmt(strerror(errno))));
+  return info;
+} // fn: reap() }}}
+
+} // namespace ns_pidfd
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
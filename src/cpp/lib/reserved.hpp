@@ -5,10 +5,19 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <expected>
 #include <filesystem>
 #include <cstdint>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "../common.hpp"
 #include "../macro.hpp"
 
@@ -22,6 +31,175 @@ namespace fs = std::filesystem;
 
 } // namespace ns_reserved
 
+// class Region {{{
+// Mapping of the reserved region of a binary, created once per process. Reads copy from the
+// mapping and writes only touch and flush the bytes that change
+class Region
+{
+  private:
+    int m_fd;
+    bool m_is_writable;
+    uint64_t m_offset;
+    uint64_t m_size;
+    // The mapping starts at the page that contains the region
+    char* m_ptr_map;
+    uint64_t m_size_map;
+    char* m_ptr;
+    static std::mutex& mutex();
+    static std::map<fs::path, std::unique_ptr<Region>>& regions();
+    Region(int fd, bool is_writable, uint64_t offset, uint64_t size, char* ptr_map, uint64_t size_map);
+    char* at(uint64_t offset) const;
+  public:
+    Region(Region const&) = delete;
+    Region(Region&&) = delete;
+    Region& operator=(Region const&) = delete;
+    Region& operator=(Region&&) = delete;
+    ~Region();
+    static std::error<std::string> map(fs::path const& path_file_binary, uint64_t offset, uint64_t size);
+    static Region* find(fs::path const& path_file_binary, uint64_t offset, uint64_t size);
+    std::span<char const> view(uint64_t offset, uint64_t size) const;
+    [[nodiscard]] std::error<std::string> write(uint64_t offset, uint64_t size, const char* data, uint64_t length);
+}; // class Region }}}
+
+// Region::Region() {{{
+inline Region::Region(int fd, bool is_writable, uint64_t offset, uint64_t size, char* ptr_map, uint64_t size_map)
+  : m_fd(fd)
+  , m_is_writable(is_writable)
+  , m_offset(offset)
+  , m_size(size)
+  , m_ptr_map(ptr_map)
+  , m_size_map(size_map)
+  , m_ptr(ptr_map + (size_map - size))
+{
+} // Region::Region() }}}
+
+// Region::~Region() {{{
+inline Region::~Region()
+{
+  munmap(m_ptr_map, m_size_map);
+  close(m_fd);
+} // Region::~Region() }}}
+
+// Region::mutex() {{{
+inline std::mutex& Region::mutex()
+{
+  static std::mutex mutex;
+  return mutex;
+} // Region::mutex() }}}
+
+// Region::regions() {{{
+inline std::map<fs::path, std::unique_ptr<Region>>& Region::regions()
+{
+  static std::map<fs::path, std::unique_ptr<Region>> regions;
+  return regions;
+} // Region::regions() }}}
+
+// Region::map() {{{
+// Maps the region for the reads and writes of the process, read-only if the binary is not writable
+inline std::error<std::string> Region::map(fs::path const& path_file_binary, uint64_t offset, uint64_t size)
+{
+  std::lock_guard lock(mutex());
+  qreturn_if(regions().contains(path_file_binary), std::nullopt);
+
+  bool is_writable = true;
+  int fd = open(path_file_binary.c_str(), O_RDWR | O_CLOEXEC);
+  if ( fd < 0 )
+  {
+    is_writable = false;
+    fd = open(path_file_binary.c_str(), O_RDONLY | O_CLOEXEC);
+  } // if
+  qreturn_if(fd < 0, "Could not open '{}': {}"_fmt(path_file_binary, strerror(errno)));
+
+  // The offset of a mapping must be page aligned
+  uint64_t size_page = sysconf(_SC_PAGESIZE);
+  uint64_t offset_map = offset - offset % size_page;
+  uint64_t size_map = size + offset % size_page;
+  void* ptr_map = mmap(nullptr, size_map, PROT_READ | ((is_writable)? PROT_WRITE : 0), MAP_SHARED, fd, offset_map);
+  if ( ptr_map == MAP_FAILED )
+  {
+    int err = errno;
+    close(fd);
+    return "Could not map reserved region of '{}': {}"_fmt(path_file_binary, strerror(err));
+  } // if
+
+  regions().emplace(path_file_binary
+    , std::unique_ptr<Region>(new Region(fd, is_writable, offset, size, static_cast<char*>(ptr_map), size_map))
+  );
+  return std::nullopt;
+} // Region::map() }}}
+
+// Region::find() {{{
+// Mapping of the binary that contains the range, null if there is none
+inline Region* Region::find(fs::path const& path_file_binary, uint64_t offset, uint64_t size)
+{
+  std::lock_guard lock(mutex());
+  auto it = regions().find(path_file_binary);
+  qreturn_if(it == regions().end(), nullptr);
+  Region* region = it->second.get();
+  qreturn_if(offset < region->m_offset or offset + size > region->m_offset + region->m_size, nullptr);
+  return region;
+} // Region::find() }}}
+
+// Region::at() {{{
+inline char* Region::at(uint64_t offset) const
+{
+  return m_ptr + (offset - m_offset);
+} // Region::at() }}}
+
+// Region::view() {{{
+// Bytes of the binary in the range, valid for the lifetime of the process
+inline std::span<char const> Region::view(uint64_t offset, uint64_t size) const
+{
+  return std::span<char const>(at(offset), size);
+} // Region::view() }}}
+
+// Region::write() {{{
+// Writes data and zeroes the remainder of the slot, only the pages that changed are flushed
+inline std::error<std::string> Region::write(uint64_t offset, uint64_t size, const char* data, uint64_t length)
+{
+  qreturn_if(length > size, "Size of data exceeds available space");
+  qreturn_if(not m_is_writable, "Binary is not writable");
+  char* ptr = at(offset);
+
+  // Range of bytes that changed
+  char* ptr_beg = ptr + size;
+  char* ptr_end = ptr;
+  auto f_dirty = [&](char* beg, char* end)
+  {
+    ptr_beg = std::min(ptr_beg, beg);
+    ptr_end = std::max(ptr_end, end);
+  };
+
+  // Data
+  if ( auto [it_beg, it_data] = std::mismatch(ptr, ptr + length, data); it_beg != ptr + length )
+  {
+    auto [it_end, it_data_end] = std::mismatch(std::reverse_iterator(ptr + length)
+      , std::reverse_iterator(it_beg)
+      , std::reverse_iterator(data + length)
+    );
+    std::memcpy(it_beg, it_data, it_end.base() - it_beg);
+    f_dirty(it_beg, it_end.base());
+  } // if
+
+  // Remainder of the slot
+  auto f_nonzero = [](char c){ return c != 0; };
+  if ( char* it_beg = std::find_if(ptr + length, ptr + size, f_nonzero); it_beg != ptr + size )
+  {
+    char* it_end = std::find_if(std::reverse_iterator(ptr + size), std::reverse_iterator(it_beg), f_nonzero).base();
+    std::memset(it_beg, 0, it_end - it_beg);
+    f_dirty(it_beg, it_end);
+  } // if
+
+  // Nothing changed
+  qreturn_if(ptr_beg >= ptr_end, std::nullopt);
+
+  // Flush the pages of the changed bytes
+  uint64_t size_page = sysconf(_SC_PAGESIZE);
+  char* ptr_page = m_ptr_map + (ptr_beg - m_ptr_map) / size_page * size_page;
+  qreturn_if(msync(ptr_page, ptr_end - ptr_page, MS_SYNC) < 0, "Could not flush reserved region: {}"_fmt(strerror(errno)));
+  return std::nullopt;
+} // Region::write() }}}
+
 // write() {{{
 // Writes data to file in binary format
 // Returns space left after write
@@ -32,6 +210,11 @@ namespace fs = std::filesystem;
   , uint64_t length)
 {
   qreturn_if(length > size, std::make_optional("Size of data exceeds available space"));
+  // Write through the mapping of the process
+  if ( Region* region = Region::find(path_file_binary, offset, size) )
+  {
+    return region->write(offset, size, data, length);
+  } // if
   // Open output binary file
   std::ofstream file_binary(path_file_binary, std::ios::binary | std::ios::in | std::ios::out);
   qreturn_if(not file_binary.is_open(), std::make_optional("Failed to open input file"));
@@ -54,6 +237,12 @@ namespace fs = std::filesystem;
   , uint64_t length
   , char* data)
 {
+  // Read from the mapping of the process
+  if ( Region* region = Region::find(path_file_binary, offset, length) )
+  {
+    std::ranges::copy(region->view(offset, length), data);
+    return length;
+  } // if
   // Open binary file
   std::ifstream file_binary(path_file_binary, std::ios::binary | std::ios::in);
   qreturn_if(not file_binary.is_open(), std::unexpected("Failed to open input file"));
@@ -5,6 +5,8 @@
 
 #pragma once
 
+#include <cstring>
+#include <memory>
 #include <string>
 #include <filesystem>
 #include "../reserved.hpp"
@@ -33,15 +35,21 @@ inline std::error<std::string> write(fs::path const& path_file_binary
 } // write() }}}
 
 // read() {{{
-inline std::expected<std::unique_ptr<char[]>,std::string> read(fs::path const& path_file_binary
+// The json ends at the first null byte or at the end of the slot
+inline std::expected<std::string,std::string> read(fs::path const& path_file_binary
   , uint64_t offset
   , uint64_t size)
 {
-  std::string raw_json;
+  // View the mapping of the process
+  if ( ns_reserved::Region* region = ns_reserved::Region::find(path_file_binary, offset, size) )
+  {
+    std::span<char const> bytes = region->view(offset, size);
+    return std::string(bytes.data(), std::ranges::find(bytes, '\0') - bytes.begin());
+  } // if
   auto buffer = std::make_unique<char[]>(size);
   auto expected_read = ns_reserved::read(path_file_binary, offset, size, buffer.get());
   qreturn_if(not expected_read, std::unexpected(expected_read.error()));
-  return buffer;
+  return std::string(buffer.get(), strnlen(buffer.get(), *expected_read));
 } // read() }}}
 
 } // namespace ns_reserved::ns_desktop
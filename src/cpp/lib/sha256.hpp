@@ -0,0 +1,159 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : sha256
+///
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <string>
+
+namespace ns_sha256
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+constexpr std::array<uint32_t,64> const k =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+constexpr uint32_t rotr(uint32_t x, uint32_t n)
+{
+  return (x >> n) | (x << (32 - n));
+} // rotr
+
+} // anonymous namespace
+
+// class Sha256 {{{
+class Sha256
+{
+  private:
+    std::array<uint32_t,8> m_state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::array<uint8_t,64> m_block{};
+    uint64_t m_size_block = 0;
+    uint64_t m_size_total = 0;
+
+    void transform(uint8_t const* data);
+
+  public:
+    Sha256& update(void const* data, uint64_t size);
+    std::string digest();
+}; // class Sha256 }}}
+
+// fn: Sha256::transform {{{
+inline void Sha256::transform(uint8_t const* data)
+{
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i)
+  {
+    w[i] = (uint32_t{data[i*4]} << 24) | (uint32_t{data[i*4+1]} << 16) | (uint32_t{data[i*4+2]} << 8) | uint32_t{data[i*4+3]};
+  } // for
+  for (int i = 16; i < 64; ++i)
+  {
+    uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+    uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  } // for
+  auto [a, b, c, d, e, f, g, h] = m_state;
+  for (int i = 0; i < 64; ++i)
+  {
+    uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + k[i] + w[i];
+    uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+  } // for
+  m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+  m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+} // fn: Sha256::transform }}}
+
+// fn: Sha256::update {{{
+inline Sha256& Sha256::update(void const* data, uint64_t size)
+{
+  uint8_t const* bytes = static_cast<uint8_t const*>(data);
+  m_size_total += size;
+  // Fill pending block
+  if ( m_size_block > 0 )
+  {
+    uint64_t size_copy = std::min(size, m_block.size() - m_size_block);
+    std::memcpy(m_block.data() + m_size_block, bytes, size_copy);
+    m_size_block += size_copy; bytes += size_copy; size -= size_copy;
+    if ( m_size_block < m_block.size() ) { return *this; }
+    transform(m_block.data());
+    m_size_block = 0;
+  } // if
+  // Process whole blocks directly from the input
+  for (; size >= m_block.size(); bytes += m_block.size(), size -= m_block.size())
+  {
+    transform(bytes);
+  } // for
+  // Keep the remainder
+  std::memcpy(m_block.data(), bytes, size);
+  m_size_block = size;
+  return *this;
+} // fn: Sha256::update }}}
+
+// fn: Sha256::digest {{{
+// Finalizes the hash and returns it as a lowercase hex string
+inline std::string Sha256::digest()
+{
+  uint64_t size_bits = m_size_total * 8;
+  uint8_t padding[72]{0x80};
+  uint64_t size_padding = (m_size_block < 56)? 56 - m_size_block : 120 - m_size_block;
+  for (int i = 0; i < 8; ++i)
+  {
+    padding[size_padding + i] = static_cast<uint8_t>(size_bits >> (56 - i*8));
+  } // for
+  update(padding, size_padding + 8);
+  std::string hex;
+  for (uint32_t word : m_state)
+  {
+    hex += std::format("{:08x}", word);
+  } // for
+  return hex;
+} // fn: Sha256::digest }}}
+
+// fn: file {{{
+// Hash of 'size' bytes of a file starting at 'offset'
+inline std::expected<std::string,std::string> file(fs::path const& path_file
+  , uint64_t offset = 0
+  , uint64_t size = std::numeric_limits<uint64_t>::max())
+{
+  std::ifstream file(path_file, std::ios::binary);
+  if ( not file.is_open() ) { return std::unexpected("Could not open file '" + path_file.string() + "'"); }
+  file.seekg(offset);
+  Sha256 sha256;
+  char buff[65536];
+  while ( size > 0 )
+  {
+    file.read(buff, std::min<uint64_t>(sizeof(buff), size));
+    if ( file.gcount() <= 0 ) { break; }
+    sha256.update(buff, file.gcount());
+    size -= file.gcount();
+  } // while
+  return sha256.digest();
+} // fn: file }}}
+
+} // namespace ns_sha256
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
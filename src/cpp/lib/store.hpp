@@ -0,0 +1,179 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : store
+///
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dwarfs.hpp"
+#include "env.hpp"
+#include "sha256.hpp"
+#include "../macro.hpp"
+
+// Per-user store of dwarfs layers addressed by the sha256 digest of their contents, images that
+// reference the same digest share a single copy on disk
+
+namespace ns_store
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+} // anonymous namespace
+
+// fn: path_dir() {{{
+// Location of the store, $XDG_DATA_HOME/flatimage/layers
+inline std::expected<fs::path,std::string> path_dir()
+{
+  auto opt_path_dir_data = ns_env::xdg_data_home<std::string>();
+  qreturn_if(not opt_path_dir_data, std::unexpected("Could not determine XDG_DATA_HOME"));
+  fs::path path_dir_store = fs::path{*opt_path_dir_data} / "flatimage" / "layers";
+  std::error_code ec;
+  fs::create_directories(path_dir_store, ec);
+  qreturn_if(ec, std::unexpected("Could not create store directory '{}': {}"_fmt(path_dir_store, ec.message())));
+  return path_dir_store;
+} // fn: path_dir() }}}
+
+// fn: is_digest() {{{
+inline bool is_digest(std::string_view str)
+{
+  return str.size() == 64 and std::ranges::all_of(str, [](char c){ return std::isxdigit(c) and not std::isupper(c); });
+} // fn: is_digest() }}}
+
+// fn: stamp() {{{
+// Identifies the version of a file on disk, the modification time, size and inode change if the
+// file is replaced or written to
+inline std::expected<std::string,std::string> stamp(fs::path const& path_file)
+{
+  struct stat st;
+  qreturn_if(::stat(path_file.c_str(), &st) < 0, std::unexpected("Could not stat '{}': {}"_fmt(path_file, strerror(errno))));
+  return "{}.{}:{}:{}"_fmt(st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size, st.st_ino);
+} // fn: stamp() }}}
+
+// fn: record() {{{
+// Keeps the stamp of a layer whose contents matched its digest, replaced atomically for concurrent
+// readers
+inline void record(fs::path const& path_file_verified, std::string const& digest, std::string const& stamp)
+{
+  fs::path path_file_tmp = "{}.{}.tmp"_fmt(path_file_verified, getpid());
+  std::ofstream file_tmp(path_file_tmp, std::ios::trunc);
+  if ( file_tmp << stamp << '\n' )
+  {
+    file_tmp.close();
+    std::error_code ec;
+    fs::rename(path_file_tmp, path_file_verified, ec);
+    elog_if(ec, "Could not record verified layer '{}': {}"_fmt(digest, ec.message()));
+  } // if
+} // fn: record() }}}
+
+// fn: path_file_verified() {{{
+inline fs::path path_file_verified(fs::path const& path_file_layer, std::string const& digest)
+{
+  return path_file_layer.parent_path() / ".{}.verified"_fmt(digest);
+} // fn: path_file_verified() }}}
+
+// fn: verify() {{{
+// Checks that the contents of the layer match its digest. Hashing a layer takes as long as reading
+// it, so the stamp of the verified file is kept next to it and the layer is only hashed again once
+// it changes
+inline std::expected<void,std::string> verify(fs::path const& path_file_layer, std::string const& digest)
+{
+  fs::path path_file_verified = ns_store::path_file_verified(path_file_layer, digest);
+  auto expected_stamp = stamp(path_file_layer);
+  qreturn_if(not expected_stamp, std::unexpected(expected_stamp.error()));
+  // Verified before
+  std::string stamp_verified;
+  std::ifstream file_verified(path_file_verified);
+  qreturn_if(file_verified.is_open() and std::getline(file_verified, stamp_verified) and stamp_verified == *expected_stamp, {});
+  file_verified.close();
+  // Hash layer contents
+  auto expected_digest = ns_sha256::file(path_file_layer);
+  qreturn_if(not expected_digest, std::unexpected(expected_digest.error()));
+  qreturn_if(*expected_digest != digest
+    , std::unexpected("Layer '{}' is corrupted, its contents hash to '{}'"_fmt(digest, *expected_digest))
+  );
+  record(path_file_verified, digest, *expected_stamp);
+  return {};
+} // fn: verify() }}}
+
+// fn: get() {{{
+// Path to the layer with the given digest, fails if its contents do not match the digest
+inline std::expected<fs::path,std::string> get(std::string const& digest)
+{
+  qreturn_if(not is_digest(digest), std::unexpected("Invalid layer digest '{}'"_fmt(digest)));
+  auto expected_path_dir_store = path_dir();
+  qreturn_if(not expected_path_dir_store, std::unexpected(expected_path_dir_store.error()));
+  fs::path path_file_layer = *expected_path_dir_store / digest;
+  qreturn_if(not fs::exists(path_file_layer), std::unexpected("Layer '{}' is not in the store"_fmt(digest)));
+  auto expected_verify = verify(path_file_layer, digest);
+  qreturn_if(not expected_verify, std::unexpected(expected_verify.error()));
+  return path_file_layer;
+} // fn: get() }}}
+
+// fn: add() {{{
+// Imports a dwarfs layer into the store and returns its digest, existing layers are not copied
+inline std::expected<std::string,std::string> add(fs::path const& path_file_layer)
+{
+  qreturn_if(not ns_dwarfs::is_dwarfs(path_file_layer, 0), std::unexpected("Invalid dwarfs filesystem '{}'"_fmt(path_file_layer)));
+  auto expected_path_dir_store = path_dir();
+  qreturn_if(not expected_path_dir_store, std::unexpected(expected_path_dir_store.error()));
+  // Hash layer contents
+  auto expected_digest = ns_sha256::file(path_file_layer);
+  qreturn_if(not expected_digest, std::unexpected(expected_digest.error()));
+  fs::path path_file_dst = *expected_path_dir_store / *expected_digest;
+  if ( fs::exists(path_file_dst) )
+  {
+    ns_log::debug()("Layer '{}' already in the store", *expected_digest);
+    return *expected_digest;
+  } // if
+  // Copy to a temporary file in the same directory, then rename so readers never see a partial layer
+  std::error_code ec;
+  fs::path path_file_tmp = path_file_dst.string() + ".{}.tmp"_fmt(getpid());
+  fs::copy_file(path_file_layer, path_file_tmp, fs::copy_options::overwrite_existing, ec);
+  qreturn_if(ec, std::unexpected("Could not copy layer to the store: {}"_fmt(ec.message())));
+  if ( int fd = ::open(path_file_tmp.c_str(), O_RDONLY); fd >= 0 )
+  {
+    ::fsync(fd);
+    ::close(fd);
+  } // if
+  // Layers are immutable once stored
+  fs::permissions(path_file_tmp, fs::perms::owner_read | fs::perms::group_read | fs::perms::others_read, ec);
+  if ( ec )
+  {
+    lec(fs::remove, path_file_tmp);
+    return std::unexpected("Could not set permissions of the stored layer: {}"_fmt(ec.message()));
+  } // if
+  fs::rename(path_file_tmp, path_file_dst, ec);
+  if ( ec )
+  {
+    lec(fs::remove, path_file_tmp);
+    return std::unexpected("Could not move layer into the store: {}"_fmt(ec.message()));
+  } // if
+  // The copy has the contents hashed above, so the first get() does not hash it again
+  if ( auto expected_stamp = stamp(path_file_dst) )
+  {
+    record(path_file_verified(path_file_dst, *expected_digest), *expected_digest, *expected_stamp);
+  } // if
+  else
+  {
+    ns_log::error()("Could not record verified layer: {}", expected_stamp.error());
+  } // else
+  ns_log::info()("Stored layer '{}' as '{}'", path_file_layer, *expected_digest);
+  return *expected_digest;
+} // fn: add() }}}
+
+} // namespace ns_store
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
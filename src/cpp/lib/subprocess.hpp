@@ -5,18 +5,33 @@
 
 #pragma once
 
+#include <charconv>
+#include <cstdio>
 #include <cstring>
+#include <fcntl.h>
+#include <fstream>
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sched.h>
+#include <thread>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/wait.h>
 #include <csignal>
 #include <vector>
 #include <string>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/prctl.h>
 #include <ranges>
 
 #include "log.hpp"
+#include "pidfd.hpp"
 #include "../macro.hpp"
 #include "../std/vector.hpp"
 
@@ -30,48 +45,331 @@ namespace fs = std::filesystem;
 
 } // namespace
 
-// search_path() {{{
-inline std::optional<std::string> search_path(std::string const& s)
+// class Registry {{{
+// Absolute paths of tools, bundled tools are registered once at boot and lookups in PATH are
+// memoized, including misses, until PATH changes
+class Registry
+{
+  private:
+    std::mutex m_mutex;
+    std::string m_path;
+    std::map<std::string, std::string> m_map_bundled;
+    std::map<std::string, std::optional<std::string>> m_map_host;
+    Registry() = default;
+    static std::optional<std::string> scan(std::string const& path, std::string const& name);
+  public:
+    static Registry& get();
+    void add(fs::path const& path_dir);
+    std::optional<std::string> find(std::string const& name);
+}; // class Registry }}}
+
+// Registry::get() {{{
+inline Registry& Registry::get()
+{
+  static Registry registry;
+  return registry;
+} // Registry::get() }}}
+
+// Registry::scan() {{{
+inline std::optional<std::string> Registry::scan(std::string const& path, std::string const& name)
+{
+  for (auto&& e : path | std::views::split(':'))
+  {
+    fs::path path_file = fs::path(e.begin(), e.end()) / name;
+    qreturn_if(fs::exists(path_file), path_file.string());
+  } // for
+  return std::nullopt;
+} // Registry::scan() }}}
+
+// Registry::add() {{{
+// Registers every entry of a directory of bundled tools, which must take precedence in PATH
+inline void Registry::add(fs::path const& path_dir)
+{
+  std::lock_guard lock(m_mutex);
+  std::error_code ec;
+  for (auto it = fs::directory_iterator(path_dir, ec); not ec and it != fs::directory_iterator(); it.increment(ec))
+  {
+    m_map_bundled.insert_or_assign(it->path().filename().string(), it->path().string());
+  } // for
+  elog_if(ec, "Could not register tools in '{}': {}"_fmt(path_dir, ec.message()));
+} // Registry::add() }}}
+
+// Registry::find() {{{
+inline std::optional<std::string> Registry::find(std::string const& name)
 {
+  std::lock_guard lock(m_mutex);
+  auto it_bundled = m_map_bundled.find(name);
+  qreturn_if(it_bundled != m_map_bundled.end(), it_bundled->second);
+
   const char* cstr_path = getenv("PATH");
   ereturn_if(cstr_path == nullptr, "PATH: Could not read PATH", std::nullopt);
 
-  std::string str_path{cstr_path};
-  auto view = str_path | std::views::split(':');
-  auto it = std::find_if(view.begin(), view.end(), [&](auto&& e)
+  // Invalidate host lookups on PATH change
+  if ( m_path != cstr_path )
   {
-    ns_log::debug()("PATH: Check for {}", fs::path(e.begin(), e.end()) / s);
-    return fs::exists(fs::path(e.begin(), e.end()) / s);
-  });
+    m_map_host.clear();
+    m_path = cstr_path;
+  } // if
 
-  if (it != view.end())
+  auto it = m_map_host.find(name);
+  if ( it == m_map_host.end() )
   {
-    auto result = fs::path((*it).begin(), (*it).end()) / s;
-    ns_log::debug()("PATH: Found '{}'", result);
-    return result;
+    it = m_map_host.emplace(name, scan(m_path, name)).first;
+    ns_log::debug()("PATH: Resolved '{}' to '{}'", name, it->second.value_or("<not found>"));
   } // if
+  return it->second;
+} // Registry::find() }}}
 
-  ns_log::debug()("PATH: Could not find '{}'", s);
-  return std::nullopt;
+// search_path() {{{
+inline std::optional<std::string> search_path(std::string const& s)
+{
+  return Registry::get().find(s);
 } // search_path()}}}
 
+// class Reader {{{
+// Single epoll thread shared by all subprocesses, forwards each line of their piped outputs to the
+// handler of the subprocess
+class Reader
+{
+  private:
+    struct Pipe
+    {
+      std::function<void(std::string)> f;
+      std::string buffer;
+    };
+    int m_fd_epoll;
+    std::mutex m_mutex;
+    std::map<int, Pipe> m_map;
+    Reader();
+    void loop();
+    bool pump(int fd, Pipe& pipe);
+    void drop(std::map<int, Pipe>::iterator it);
+  public:
+    static Reader& get();
+    void add(int fd, std::function<void(std::string)> f);
+    void release(int fd);
+}; // class Reader }}}
+
+// Reader::Reader() {{{
+inline Reader::Reader()
+  : m_fd_epoll(epoll_create1(EPOLL_CLOEXEC))
+{
+  ethrow_if(m_fd_epoll < 0, "Could not create epoll instance: {}"_fmt(strerror(errno)));
+  // Lives until the process exits
+  std::thread([this]{ loop(); }).detach();
+} // Reader::Reader() }}}
+
+// Reader::get() {{{
+inline Reader& Reader::get()
+{
+  // Never destroyed, the detached thread may still use it during exit
+  static Reader* reader = new Reader();
+  return *reader;
+} // Reader::get() }}}
+
+// Reader::loop() {{{
+inline void Reader::loop()
+{
+  while ( true )
+  {
+    epoll_event events[16];
+    int count_events = epoll_wait(m_fd_epoll, events, std::size(events), -1);
+    qcontinue_if(count_events < 0 and errno == EINTR);
+    ebreak_if(count_events < 0, "epoll_wait failed: {}"_fmt(strerror(errno)));
+    std::lock_guard lock(m_mutex);
+    for (int i = 0; i < count_events; ++i)
+    {
+      // Released by its subprocess meanwhile
+      auto it = m_map.find(events[i].data.fd);
+      qcontinue_if(it == m_map.end());
+      if ( pump(it->first, it->second) ) { drop(it); }
+    } // for
+  } // while
+} // Reader::loop() }}}
+
+// Reader::pump() {{{
+// Reads what is available in the pipe and forwards complete lines, returns true once the write end
+// is closed
+inline bool Reader::pump(int fd, Pipe& pipe)
+{
+  char buffer[4096];
+  bool is_finished = false;
+  while ( true )
+  {
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if ( count > 0 ) { pipe.buffer.append(buffer, count); continue; }
+    qcontinue_if(count < 0 and errno == EINTR);
+    is_finished = (count == 0 or errno != EAGAIN);
+    break;
+  } // while
+  for (size_t pos; (pos = pipe.buffer.find('\n')) != std::string::npos; pipe.buffer.erase(0, pos + 1))
+  {
+    if ( pos > 0 ) { pipe.f(pipe.buffer.substr(0, pos)); }
+  } // for
+  return is_finished;
+} // Reader::pump() }}}
+
+// Reader::drop() {{{
+// Stops watching the pipe, its descriptor is closed by the owner in release() so the number cannot
+// be reused by another pipe while the owner still refers to it
+inline void Reader::drop(std::map<int, Pipe>::iterator it)
+{
+  epoll_ctl(m_fd_epoll, EPOLL_CTL_DEL, it->first, nullptr);
+  // Last line without a newline
+  if ( not it->second.buffer.empty() ) { it->second.f(it->second.buffer); }
+  m_map.erase(it);
+} // Reader::drop() }}}
+
+// Reader::add() {{{
+// Watches the read end of a pipe, which stays open until its owner calls release()
+inline void Reader::add(int fd, std::function<void(std::string)> f)
+{
+  std::lock_guard lock(m_mutex);
+  ereturn_if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0, "Could not set pipe to non-blocking: {}"_fmt(strerror(errno)));
+  m_map.insert_or_assign(fd, Pipe{ .f = std::move(f), .buffer = {} });
+  epoll_event event{ .events = EPOLLIN, .data = { .fd = fd } };
+  if ( epoll_ctl(m_fd_epoll, EPOLL_CTL_ADD, fd, &event) < 0 )
+  {
+    ns_log::error()("Could not watch pipe: {}", strerror(errno));
+    drop(m_map.find(fd));
+  } // if
+} // Reader::add() }}}
+
+// Reader::release() {{{
+// Forwards what is left in the pipe and closes it, descendants that keep the write end open (e.g.,
+// daemons) do not hold back the subprocess
+inline void Reader::release(int fd)
+{
+  std::lock_guard lock(m_mutex);
+  if ( auto it = m_map.find(fd); it != m_map.end() )
+  {
+    std::ignore = pump(it->first, it->second);
+    drop(it);
+  } // if
+  close(fd);
+} // Reader::release() }}}
+
+// class Block {{{
+// Null terminated strings laid out contiguously in a single buffer, followed by the pointer table
+// execve expects, built with two allocations regardless of the number of strings
+class Block
+{
+  private:
+    std::string m_buffer;
+    std::vector<char*> m_ptrs;
+  public:
+    template<std::ranges::range R>
+    explicit Block(R&& strings);
+    char* const* data();
+}; // class Block }}}
+
+// Block::Block() {{{
+template<std::ranges::range R>
+Block::Block(R&& strings)
+{
+  size_t size = 0;
+  size_t count = 0;
+  for (std::string_view e : strings) { size += e.size() + 1; ++count; }
+  // Reserved up front, pointers stay valid while appending
+  m_buffer.reserve(size);
+  m_ptrs.reserve(count + 1);
+  for (std::string_view e : strings)
+  {
+    m_ptrs.push_back(m_buffer.data() + m_buffer.size());
+    m_buffer.append(e);
+    m_buffer.push_back('\0');
+  } // for
+  m_ptrs.push_back(nullptr);
+} // Block::Block() }}}
+
+// Block::data() {{{
+inline char* const* Block::data()
+{
+  return m_ptrs.data();
+} // Block::data() }}}
+
+// class Environment {{{
+// 'KEY=VALUE' entries indexed by key, insertion and removal do not scan or split other entries
+class Environment
+{
+  private:
+    std::vector<std::string> m_entries;
+    std::unordered_map<std::string, size_t> m_index;
+    static std::string_view key(std::string_view entry);
+  public:
+    void set(std::string entry);
+    void erase(std::string_view key);
+    void clear();
+    std::vector<std::string> const& entries() const;
+}; // class Environment }}}
+
+// Environment::key() {{{
+inline std::string_view Environment::key(std::string_view entry)
+{
+  return entry.substr(0, entry.find('='));
+} // Environment::key() }}}
+
+// Environment::set() {{{
+// Replaces the entry with the same key
+inline void Environment::set(std::string entry)
+{
+  elog_if(entry.find('=') == std::string::npos, "Entry '{}' is not valid"_fmt(entry));
+  std::string k{key(entry)};
+  if ( auto it = m_index.find(k); it != m_index.end() )
+  {
+    m_entries[it->second] = std::move(entry);
+    return;
+  } // if
+  m_index.emplace(std::move(k), m_entries.size());
+  m_entries.push_back(std::move(entry));
+} // Environment::set() }}}
+
+// Environment::erase() {{{
+// The last entry takes the place of the erased one, the order of the environment is not kept
+inline void Environment::erase(std::string_view k)
+{
+  auto it = m_index.find(std::string{k});
+  qreturn_if(it == m_index.end());
+  ns_log::debug()("Erased var entry: {}", m_entries[it->second]);
+  size_t index = it->second;
+  m_index.erase(it);
+  if ( index != m_entries.size() - 1 )
+  {
+    m_entries[index] = std::move(m_entries.back());
+    m_index[std::string{key(m_entries[index])}] = index;
+  } // if
+  m_entries.pop_back();
+} // Environment::erase() }}}
+
+// Environment::clear() {{{
+inline void Environment::clear()
+{
+  m_entries.clear();
+  m_index.clear();
+} // Environment::clear() }}}
+
+// Environment::entries() {{{
+inline std::vector<std::string> const& Environment::entries() const
+{
+  return m_entries;
+} // Environment::entries() }}}
+
 // class Subprocess {{{
 class Subprocess
 {
   private:
     std::string m_program;
     std::vector<std::string> m_args;
-    std::vector<std::string> m_env;
+    Environment m_env;
     std::optional<pid_t> m_opt_pid;
-    std::vector<pid_t> m_vec_pids_pipe;
+    std::optional<int> m_opt_pidfd;
+    std::vector<int> m_fds_pipe;
     std::optional<std::function<void(std::string)>> m_fstdout;
     std::optional<std::function<void(std::string)>> m_fstderr;
     bool m_with_piped_outputs;
     std::optional<pid_t> m_die_on_pid;
+    std::vector<int> m_fds_inherited;
 
-    [[nodiscard]] Subprocess& with_pipes_parent(int pipestdout[2], int pipestderr[2]);
-    void with_pipes_child(int pipestdout[2], int pipestderr[2]);
-    void die_on_pid(pid_t pid);
   public:
     template<ns_concept::StringRepresentable T>
     [[nodiscard]] Subprocess(T&& t);
@@ -94,6 +392,8 @@ class Subprocess
 
     [[nodiscard]] std::optional<pid_t> get_pid();
 
+    [[nodiscard]] std::optional<int> get_pidfd();
+
     void kill(int signal);
 
     template<typename Arg, typename... Args>
@@ -112,6 +412,8 @@ class Subprocess
 
     [[nodiscard]] Subprocess& with_die_on_pid(pid_t pid);
 
+    [[nodiscard]] Subprocess& with_inherited_fd(int fd);
+
     [[nodiscard]] Subprocess& with_piped_outputs();
 
     template<typename F>
@@ -123,6 +425,8 @@ class Subprocess
     [[nodiscard]] Subprocess& spawn();
 
     [[nodiscard]] std::optional<int> wait();
+
+    [[nodiscard]] bool wait_exit(std::chrono::milliseconds timeout);
 }; // Subprocess }}}
 
 // Subprocess::Subprocess {{{
@@ -136,14 +440,15 @@ Subprocess::Subprocess(T&& t)
   // Copy environment
   for(char** i = environ; *i != nullptr; ++i)
   {
-    m_env.push_back(*i);
+    m_env.set(*i);
   } // for
 } // Subprocess }}}
 
 // Subprocess::~Subprocess {{{
 inline Subprocess::~Subprocess()
 {
-  std::ignore = this->wait();
+  if ( m_opt_pid ) { std::ignore = this->wait(); }
+  if ( m_opt_pidfd ) { close(*m_opt_pidfd); }
 } // Subprocess::~Subprocess }}}
 
 // env_clear() {{{
@@ -157,8 +462,7 @@ inline Subprocess& Subprocess::env_clear()
 template<ns_concept::StringRepresentable K, ns_concept::StringRepresentable V>
 Subprocess& Subprocess::with_var(K&& k, V&& v)
 {
-  rm_var(k);
-  m_env.push_back("{}={}"_fmt(k,v));
+  m_env.set("{}={}"_fmt(k,v));
   return *this;
 } // with_var() }}}
 
@@ -166,21 +470,7 @@ Subprocess& Subprocess::with_var(K&& k, V&& v)
 template<ns_concept::StringRepresentable K>
 Subprocess& Subprocess::rm_var(K&& k)
 {
-  // Find variable
-  auto it = std::ranges::find_if(m_env, [&](std::string const& e)
-  {
-    auto vec = ns_vector::from_string(e, '=');
-    qreturn_if(vec.empty(), false);
-    return vec.front() == k;
-  });
-
-  // Erase if found
-  if ( it != std::ranges::end(m_env) )
-  {
-    ns_log::debug()("Erased var entry: {}", *it);
-    m_env.erase(it);
-  } // if
-
+  m_env.erase(ns_string::to_string(k));
   return *this;
 } // rm_var() }}}
 
@@ -190,13 +480,27 @@ inline std::optional<pid_t> Subprocess::get_pid()
   return this->m_opt_pid;
 } // get_pid() }}}
 
+// get_pidfd() {{{
+// Becomes readable once the child exits, stays valid until destruction
+inline std::optional<int> Subprocess::get_pidfd()
+{
+  return this->m_opt_pidfd;
+} // get_pidfd() }}}
+
 // kill() {{{
 inline void Subprocess::kill(int signal)
 {
-  if ( auto opt_pid = this->get_pid(); opt_pid )
+  // The pidfd cannot refer to another process if the pid was reused
+  if ( m_opt_pidfd )
   {
-    ::kill(*opt_pid, signal);
+    elog_if(not ns_pidfd::send_signal(*m_opt_pidfd, signal) and errno != ESRCH
+      , "Could not send signal '{}': {}"_fmt(signal, strerror(errno))
+    );
   } // if
+  else if ( auto opt_pid = this->get_pid(); opt_pid )
+  {
+    ::kill(*opt_pid, signal);
+  } // else if
 } // kill() }}}
 
 // with_args() {{{
@@ -243,32 +547,17 @@ Subprocess& Subprocess::with_env(Arg&& arg, Args&&... args)
 template<typename T>
 Subprocess& Subprocess::with_env(T&& t)
 {
-  auto f_erase_existing = [this](auto&& entries)
-  {
-    for (auto&& entry : entries)
-    {
-      auto parts = ns_vector::from_string(entry, '=');
-      econtinue_if(parts.size() < 2, "Entry '{}' is not valid"_fmt(entry));
-      std::string key = parts.front();
-      std::ignore = this->rm_var(key);
-    } // for
-  };
-
   if constexpr ( ns_concept::SameAs<T, std::string> )
   {
-    f_erase_existing(std::vector<std::string>{t});
-    this->m_env.push_back(std::forward<T>(t));
+    m_env.set(std::forward<T>(t));
   } // if
   else if constexpr ( ns_concept::IterableConst<T> )
   {
-    f_erase_existing(t);
-    std::ranges::copy(t, std::back_inserter(m_env));
+    std::ranges::for_each(t, [this](auto&& e){ m_env.set(ns_string::to_string(e)); });
   } // else if
   else if constexpr ( ns_concept::StringRepresentable<T> )
   {
-    auto entry = ns_string::to_string(std::forward<T>(t));
-    f_erase_existing(std::vector<std::string>{entry});
-    this->m_env.push_back(entry);
+    m_env.set(ns_string::to_string(std::forward<T>(t)));
   } // else if
   else
   {
@@ -285,6 +574,14 @@ inline Subprocess& Subprocess::with_die_on_pid(pid_t pid)
   return *this;
 } // with_die_on_pid }}}
 
+// with_inherited_fd() {{{
+// Clears close-on-exec of 'fd' in the child only, so concurrent spawns of the parent do not leak it
+inline Subprocess& Subprocess::with_inherited_fd(int fd)
+{
+  m_fds_inherited.push_back(fd);
+  return *this;
+} // with_inherited_fd }}}
+
 // with_piped_outputs() {{{
 inline Subprocess& Subprocess::with_piped_outputs()
 {
@@ -292,86 +589,6 @@ inline Subprocess& Subprocess::with_piped_outputs()
   return *this;
 } // with_piped_outputs() }}}
 
-// with_pipes_parent() {{{
-inline Subprocess& Subprocess::with_pipes_parent(int pipestdout[2], int pipestderr[2])
-{
-  // Close write end
-  ereturn_if(close(pipestdout[1]) == -1, "pipestdout[1]: {}"_fmt(strerror(errno)), *this);
-  ereturn_if(close(pipestderr[1]) == -1, "pipestderr[1]: {}"_fmt(strerror(errno)), *this);
-
-  auto f_read_pipe = [this](int id_pipe, std::string_view prefix, auto&& f)
-  {
-    // Fork
-    pid_t ppid = getpid();
-    pid_t pid = fork();
-    ereturn_if(pid < 0, "Could not fork '{}'"_fmt(strerror(errno)));
-    // Parent ends here
-    if (pid > 0 )
-    {
-      m_vec_pids_pipe.push_back(pid);
-      return;
-    } // if
-    // Die with parent
-    eabort_if(prctl(PR_SET_PDEATHSIG, SIGKILL) < 0, strerror(errno));
-    eabort_if(::kill(ppid, 0) < 0, "Parent died, prctl will not have effect: {}"_fmt(strerror(errno)));
-    // Check if 'f' is defined
-    if ( not f ) { f = [&](auto&& e) { ns_log::debug()("{}({}): {}", prefix, m_program, e); }; }
-    // Apply f to incoming data from pipe
-    char buffer[1024];
-    ssize_t count;
-    while ((count = read(id_pipe, buffer, sizeof(buffer))) != 0)
-    {
-      // Failed to read
-      ebreak_if(count == -1, "broke parent read loop: {}"_fmt(strerror(errno)));
-      // Split newlines and print each line with prefix
-      std::ranges::for_each(std::string(buffer, count)
-          | std::views::split('\n')
-          | std::views::filter([&](auto&& e){ return not e.empty(); })
-        , [&](auto&& e){ (*f)(std::string{e.begin(), e.end()});
-      });
-    } // while
-    close(id_pipe);
-    // Exit normally
-    exit(0);
-  };
-  // Create pipes from fifo to ostream
-  f_read_pipe(pipestdout[0], "stdout", this->m_fstdout);
-  f_read_pipe(pipestderr[0], "stderr", this->m_fstderr);
-
-  return *this;
-} // with_pipes_parent() }}}
-
-// with_pipes_child() {{{
-inline void Subprocess::with_pipes_child(int pipestdout[2], int pipestderr[2])
-{
-  // Close read end
-  ereturn_if(close(pipestdout[0]) == -1, "pipestdout[0]: {}"_fmt(strerror(errno)));
-  ereturn_if(close(pipestderr[0]) == -1, "pipestderr[0]: {}"_fmt(strerror(errno)));
-
-  // Make the opened pipe the replace stdout
-  ereturn_if(dup2(pipestdout[1], STDOUT_FILENO) == -1, "dup2(pipestdout[1]): {}"_fmt(strerror(errno)));
-  ereturn_if(dup2(pipestderr[1], STDERR_FILENO) == -1, "dup2(pipestderr[1]): {}"_fmt(strerror(errno)));
-
-  // Close original write end after duplication
-  ereturn_if(close(pipestdout[1]) == -1, "pipestdout[1]: {}"_fmt(strerror(errno)));
-  ereturn_if(close(pipestderr[1]) == -1, "pipestderr[1]: {}"_fmt(strerror(errno)));
-} // with_pipes_child() }}}
-
-// die_on_pid() {{{
-inline void Subprocess::die_on_pid(pid_t pid)
-{
-  // Set death signal when pid dies
-  ereturn_if(prctl(PR_SET_PDEATHSIG, SIGKILL) < 0, strerror(errno));
-  // Abort if pid is not running
-  if (::kill(pid, 0) < 0)
-  {
-    ns_log::error()("Parent died, prctl will not have effect: {}", strerror(errno));
-    std::abort();
-  } // if
-  // Log pid and current pid
-  ns_log::debug()("{} dies with {}", getpid(), pid);
-} // die_on_pid() }}}
-
 // with_stdout_handle() {{{
 template<typename F>
 Subprocess& Subprocess::with_stdout_handle(F&& f)
@@ -389,37 +606,131 @@ Subprocess& Subprocess::with_stderr_handle(F&& f)
 } // with_stderr_handle }}}
 
 // wait() {{{
+// Reaps the child, its pid is forgotten since the kernel may reuse it afterwards
 inline std::optional<int> Subprocess::wait()
 {
   // Check if pid is valid
   ereturn_if( not m_opt_pid or *m_opt_pid <= 0, "Invalid pid to wait for", std::nullopt);
 
-  // Wait for current process
-  int status;
-  waitpid(*m_opt_pid, &status, 0);
-
-  // Send SIGTERM for reader forks
-  std::ranges::for_each(m_vec_pids_pipe, [](pid_t pid){ ::kill(pid, SIGTERM); });
+  // Reap through the pidfd when available
+  std::optional<int> opt_code;
+  std::expected<siginfo_t,std::string> expected_info = std::unexpected("No pidfd");
+  if ( m_opt_pidfd ) { expected_info = ns_pidfd::reap(*m_opt_pidfd); }
+  if ( expected_info )
+  {
+    opt_code = (expected_info->si_code == CLD_EXITED)? std::make_optional(expected_info->si_status) : std::nullopt;
+  } // if
+  // Kernels older than 5.4 cannot wait on a pidfd
+  else
+  {
+    int status;
+    int ret;
+    while ( (ret = waitpid(*m_opt_pid, &status, 0)) < 0 and errno == EINTR ) {}
+    elog_if(ret < 0, "Could not wait for '{}': {}"_fmt(*m_opt_pid, strerror(errno)));
+    opt_code = (ret > 0 and WIFEXITED(status))? std::make_optional(WEXITSTATUS(status)) : std::nullopt;
+  } // else
+  m_opt_pid.reset();
 
-  // Wait for forks
-  std::ranges::for_each(m_vec_pids_pipe, [](pid_t pid){ waitpid(pid, nullptr, 0); });
+  // Forward remaining output and close pipes
+  std::ranges::for_each(m_fds_pipe, [](int fd){ Reader::get().release(fd); });
+  m_fds_pipe.clear();
 
-  return (WIFEXITED(status))? std::make_optional(WEXITSTATUS(status)) : std::nullopt;
+  return opt_code;
 } // wait() }}}
 
+// wait_exit() {{{
+// Waits up to 'timeout' for the child to exit without reaping it, returns true if it exited
+inline bool Subprocess::wait_exit(std::chrono::milliseconds timeout)
+{
+  ereturn_if( not m_opt_pid or *m_opt_pid <= 0, "Invalid pid to wait for", false);
+  qreturn_if(m_opt_pidfd, ns_pidfd::wait(*m_opt_pidfd, timeout));
+  // Without pidfd support check periodically
+  using namespace std::chrono_literals;
+  for (auto time_beg = std::chrono::steady_clock::now();; std::this_thread::sleep_for(10ms))
+  {
+    siginfo_t info{};
+    qreturn_if(waitid(P_PID, *m_opt_pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 and info.si_pid == *m_opt_pid, true);
+    qreturn_if(std::chrono::steady_clock::now() - time_beg >= timeout, false);
+  } // for
+} // wait_exit() }}}
+
+// struct Spawn {{{
+// Everything the child needs is prepared by the parent before clone, the child shares the memory
+// of the parent until execve, so it only performs system calls and reports failures through 'error'
+struct Spawn
+{
+  char const* path_file_program;
+  char* const* argv;
+  char* const* envp;
+  // Write ends of the output pipes, -1 if outputs are not piped
+  int fd_stdout;
+  int fd_stderr;
+  // Pid to die with, 0 if unset, and its pidfd if available
+  pid_t pid_die;
+  int pidfd_die;
+  std::vector<int> const* fds_inherited;
+  int error;
+}; // struct Spawn }}}
+
+// spawn_child() {{{
+inline int spawn_child(void* arg)
+{
+  auto spawn = static_cast<Spawn*>(arg);
+  auto f_fail = [&](int error) { spawn->error = error; _exit(127); };
+
+  // Handlers of the parent must not run on the memory shared until execve, reset the handled signals
+  // to their default action while all signals are still blocked, ignored signals stay ignored
+  for (int signal = 1; signal < NSIG; ++signal)
+  {
+    struct sigaction action{};
+    if ( sigaction(signal, nullptr, &action) < 0 or action.sa_handler == SIG_IGN ) { continue; }
+    action = {};
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, nullptr);
+  } // for
+  // Start with an empty mask instead of the one of the parent
+  sigset_t mask;
+  sigemptyset(&mask);
+  if ( sigprocmask(SIG_SETMASK, &mask, nullptr) < 0 ) { f_fail(errno); }
+
+  // Make the pipes replace stdout and stderr, dup2 clears close-on-exec
+  if ( spawn->fd_stdout >= 0 and dup2(spawn->fd_stdout, STDOUT_FILENO) < 0 ) { f_fail(errno); }
+  if ( spawn->fd_stderr >= 0 and dup2(spawn->fd_stderr, STDERR_FILENO) < 0 ) { f_fail(errno); }
+
+  // Set death signal when pid dies, fail if pid is not running
+  if ( spawn->pid_die > 0 )
+  {
+    if ( prctl(PR_SET_PDEATHSIG, SIGKILL) < 0 ) { f_fail(errno); }
+    // The pidfd is readable if the process exited, even if its pid was reused since
+    if ( spawn->pidfd_die >= 0 )
+    {
+      pollfd fd{ .fd = spawn->pidfd_die, .events = POLLIN, .revents = 0 };
+      if ( poll(&fd, 1, 0) != 0 ) { f_fail(ESRCH); }
+    } // if
+    else if ( ::kill(spawn->pid_die, 0) < 0 ) { f_fail(errno); }
+  } // if
+
+  // Keep inherited file descriptors open across execve
+  for (int fd : *spawn->fds_inherited)
+  {
+    if ( fcntl(fd, F_SETFD, 0) < 0 ) { f_fail(errno); }
+  } // for
+
+  execve(spawn->path_file_program, spawn->argv, spawn->envp);
+
+  // Child should stop here
+  f_fail(errno);
+  return 127;
+} // spawn_child() }}}
+
 // spawn() {{{
+// Spawns the child with clone(CLONE_VM|CLONE_VFORK), which skips copying the page tables of the
+// parent, piped outputs are read by the shared Reader thread
 inline Subprocess& Subprocess::spawn()
 {
   // Log
   ns_log::debug()("Spawn command: {}", m_args);
 
-  int pipestdout[2];
-  int pipestderr[2];
-
-  // Create pipe
-  ereturn_if(pipe(pipestdout), strerror(errno), *this);
-  ereturn_if(pipe(pipestderr), strerror(errno), *this);
-
   // Ignore on empty vec_argv
   if ( m_args.empty() )
   {
@@ -427,95 +738,185 @@ inline Subprocess& Subprocess::spawn()
     return *this;
   } // if
 
-  // Create child
-  m_opt_pid = fork();
-
-  // Failed to fork
-  ereturn_if(*m_opt_pid == -1, "Failed to fork", *this);
-
-  // Setup pipe on child and parent
-  // On parent, return exit code of child
-  if ( *m_opt_pid > 0 )
+  // Create pipes, close-on-exec keeps them out of concurrent spawns
+  int pipestdout[2]{-1, -1};
+  int pipestderr[2]{-1, -1};
+  if ( m_with_piped_outputs )
   {
-    if ( m_with_piped_outputs )
-    {
-      return with_pipes_parent(pipestdout, pipestderr);
-    } // if
-    else
+    ereturn_if(pipe2(pipestdout, O_CLOEXEC), strerror(errno), *this);
+    if ( pipe2(pipestderr, O_CLOEXEC) )
     {
+      ns_log::error()(strerror(errno));
+      std::ranges::for_each(pipestdout, [](int fd){ close(fd); });
       return *this;
-    } // else
+    } // if
   } // if
 
-  // On child, just setup the pipe
-  if ( m_with_piped_outputs && *m_opt_pid == 0)
-  {
-    // this is non-blocking, setup pipes and perform execve afterwards
-    with_pipes_child(pipestdout, pipestderr);
-  } // else
+  // Create null terminated arguments and environment for execve
+  Block block_argv(m_args);
+  Block block_env(m_env.entries());
 
-  // Check if should die with pid
+  // Refer to the process to die with by pidfd when available
+  int pidfd_die = -1;
   if ( m_die_on_pid )
   {
-    die_on_pid(*m_die_on_pid);
+    auto expected_pidfd_die = ns_pidfd::open(*m_die_on_pid);
+    if ( expected_pidfd_die ) { pidfd_die = *expected_pidfd_die; }
+    else { ns_log::debug()(expected_pidfd_die.error()); }
   } // if
 
-  // Create arguments for execve
-  auto argv_custom = std::make_unique<const char*[]>(m_args.size() + 1);
-
-  // Copy arguments
-  std::ranges::transform(m_args, argv_custom.get(), [](auto&& e) { return e.c_str(); });
+  // Create child, the calling thread is suspended until the child calls execve or exits
+  Spawn args
+  {
+    .path_file_program = m_program.c_str(),
+    .argv = block_argv.data(),
+    .envp = block_env.data(),
+    .fd_stdout = pipestdout[1],
+    .fd_stderr = pipestderr[1],
+    .pid_die = m_die_on_pid.value_or(0),
+    .pidfd_die = pidfd_die,
+    .fds_inherited = &m_fds_inherited,
+    .error = 0,
+  };
+  constexpr size_t const size_stack = 1 << 16;
+  auto stack = std::make_unique<char[]>(size_stack);
+  int flags = CLONE_VM | CLONE_VFORK | SIGCHLD;
+  int pidfd = -1;
+  // Block all signals until the child resets its handlers, as posix_spawn does
+  sigset_t mask_all;
+  sigset_t mask_parent;
+  sigfillset(&mask_all);
+  pthread_sigmask(SIG_SETMASK, &mask_all, &mask_parent);
+  m_opt_pid = clone(spawn_child, stack.get() + size_stack, flags | CLONE_PIDFD, &args, &pidfd);
+  // Kernels older than 5.2 do not support CLONE_PIDFD
+  if ( *m_opt_pid < 0 and errno == EINVAL )
+  {
+    m_opt_pid = clone(spawn_child, stack.get() + size_stack, flags, &args);
+  } // if
+  int errno_clone = errno;
+  pthread_sigmask(SIG_SETMASK, &mask_parent, nullptr);
+  if ( pidfd >= 0 ) { m_opt_pidfd = pidfd; }
+  if ( pidfd_die >= 0 ) { close(pidfd_die); }
 
-  // Set last entry to nullptr
-  argv_custom[m_args.size()] = nullptr;
+  // Write ends belong to the child
+  if ( m_with_piped_outputs )
+  {
+    close(pipestdout[1]);
+    close(pipestderr[1]);
+  } // if
 
-  // Set environment variables
-  std::ranges::for_each(m_env, [](auto&& e)
+  // Failed to clone
+  if ( *m_opt_pid < 0 )
   {
-    auto entry = ns_vector::from_string(e, '=');
-    ereturn_if(entry.size() < 2, "Invalid environment variable '{}'"_fmt(e));
-    setenv(entry.front().c_str()
-      , ns_string::from_container(std::next(entry.begin()), entry.end()).c_str()
-      , 1
-    );
-  });
+    ns_log::error()("Failed to clone: {}", strerror(errno_clone));
+    if ( m_with_piped_outputs ) { close(pipestdout[0]); close(pipestderr[0]); }
+    return *this;
+  } // if
 
-  // Create environment for execve
-  auto envp_custom = std::make_unique<const char*[]>(m_env.size() + 1);
+  // Child exited before execve, its exit code is collected by wait
+  elog_if(args.error != 0, "Failed to spawn '{}': {}"_fmt(m_program, strerror(args.error)));
 
-  // Copy variables
-  std::transform(m_env.begin(), m_env.end(), envp_custom.get(), [](auto&& e) { return e.c_str(); });
+  // Forward outputs to the handlers, defaults to the log
+  if ( m_with_piped_outputs )
+  {
+    auto f_handler = [this](std::string_view prefix, auto const& f) -> std::function<void(std::string)>
+    {
+      qreturn_if(f, *f);
+      return [prefix, program = m_program](std::string e) { ns_log::debug()("{}({}): {}", prefix, program, e); };
+    };
+    Reader::get().add(pipestdout[0], f_handler("stdout", m_fstdout));
+    Reader::get().add(pipestderr[0], f_handler("stderr", m_fstderr));
+    m_fds_pipe = { pipestdout[0], pipestderr[0] };
+  } // if
 
-  // Set last entry to nullptr
-  envp_custom[m_env.size()] = nullptr;
+  return *this;
+} // spawn() }}}
 
-  // Perform execve
-  execve(m_program.c_str(), (char**) argv_custom.get(), (char**) envp_custom.get());
+// holders() {{{
+// Processes other than the current one that have 'path_file_target' open or mapped, from a single
+// walk of /proc
+inline std::vector<pid_t> holders(fs::path const& path_file_target)
+{
+  struct stat stat_target;
+  ereturn_if(stat(path_file_target.c_str(), &stat_target) < 0
+    , "Could not stat '{}': {}"_fmt(path_file_target, strerror(errno))
+    , {}
+  );
+  auto f_is_target = [&](dev_t dev, ino_t ino) { return dev == stat_target.st_dev and ino == stat_target.st_ino; };
+
+  // Open file descriptors, the links resolve to the opened files
+  auto f_holds_fd = [&](fs::path const& path_dir_proc)
+  {
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(path_dir_proc / "fd", ec); not ec and it != fs::directory_iterator(); it.increment(ec))
+    {
+      struct stat stat_fd;
+      qcontinue_if(stat(it->path().c_str(), &stat_fd) < 0);
+      qreturn_if(f_is_target(stat_fd.st_dev, stat_fd.st_ino), true);
+    } // for
+    return false;
+  };
 
-  // Log error
-  ns_log::error()("execve() failed: ", strerror(errno));
+  // Memory mappings, lines are 'address perms offset major:minor inode path'
+  auto f_holds_map = [&](fs::path const& path_dir_proc)
+  {
+    std::ifstream file_maps(path_dir_proc / "maps");
+    for (std::string line; std::getline(file_maps, line);)
+    {
+      unsigned int major, minor;
+      unsigned long inode;
+      qcontinue_if(std::sscanf(line.c_str(), "%*s %*s %*s %x:%x %lu", &major, &minor, &inode) != 3 or inode == 0);
+      qreturn_if(f_is_target(makedev(major, minor), inode), true);
+    } // for
+    return false;
+  };
 
-  // Child should stop here
-  std::abort();
-} // spawn() }}}
+  std::vector<pid_t> vec_pids;
+  pid_t pid_self = getpid();
+  std::error_code ec;
+  for (auto it = fs::directory_iterator("/proc", ec); not ec and it != fs::directory_iterator(); it.increment(ec))
+  {
+    std::string name = it->path().filename();
+    pid_t pid;
+    auto [ptr, ec_pid] = std::from_chars(name.data(), name.data() + name.size(), pid);
+    qcontinue_if(ec_pid != std::errc{} or ptr != name.data() + name.size() or pid == pid_self);
+    if ( f_holds_fd(it->path()) or f_holds_map(it->path()) ) { vec_pids.push_back(pid); }
+  } // for
+  return vec_pids;
+} // holders() }}}
 
 // wait_busy_file() {{{
+// Waits until no other process holds 'path_file_target', rescans once a holder exits
 inline std::optional<std::string> wait_busy_file(fs::path const& path_file_target)
 {
-  auto path_file_lsof = search_path("lsof");
-  qreturn_if(not path_file_lsof, std::optional("Could not locate lsof binary"));
+  using namespace std::chrono_literals;
 
-  while(true)
+  for (auto vec_pids = holders(path_file_target); not vec_pids.empty(); vec_pids = holders(path_file_target))
   {
-    auto ret = Subprocess(*path_file_lsof)
-      .with_piped_outputs()
-      .with_args(path_file_target)
-      .spawn()
-      .wait();
-    ebreak_if(not ret, "Failed to query status for busy file");
-    dbreak_if(*ret != 0, "break, file is not busy");
-  } // while
+    ns_log::debug()("File '{}' is held by {}", path_file_target, vec_pids);
+    std::vector<pollfd> vec_fds;
+    bool is_exited = false;
+    for (pid_t pid : vec_pids)
+    {
+      auto expected_pidfd = ns_pidfd::open(pid);
+      if ( expected_pidfd ) { vec_fds.push_back(pollfd{ .fd = *expected_pidfd, .events = POLLIN, .revents = 0 }); }
+      // Exited since the scan
+      else if ( ::kill(pid, 0) < 0 and errno == ESRCH ) { is_exited = true; }
+    } // for
+    // Wait for any holder to exit, the timeout catches holders that close the file and keep running
+    if ( not is_exited and not vec_fds.empty() )
+    {
+      while ( poll(vec_fds.data(), vec_fds.size(), 1000) < 0 and errno == EINTR ) {}
+    } // if
+    // Kernel without pidfd support
+    else if ( not is_exited )
+    {
+      std::this_thread::sleep_for(100ms);
+    } // else if
+    std::ranges::for_each(vec_fds, [](auto const& fd){ close(fd.fd); });
+  } // for
 
+  ns_log::debug()("File '{}' is not busy", path_file_target);
   return std::nullopt;
 } // wait_busy_file()}}}
 
@@ -68,17 +68,17 @@ class UnionFs
         .with_die_on_pid(pid_to_die_for)
         .spawn();
       // Wait for mount
-      ns_fuse::wait_fuse(path_dir_mountpoint);
+      auto expected_mount = ns_fuse::wait_fuse(path_dir_mountpoint, m_subprocess->get_pidfd());
+      // Stop the helper on failure, it runs in the foreground and would keep its destructor waiting
+      if ( not expected_mount ) { m_subprocess->kill(SIGTERM); }
+      ethrow_if(not expected_mount, expected_mount.error());
     } // unionfs
 
     ~UnionFs()
     {
       ns_fuse::unmount(m_path_dir_mountpoint);
       // Tell process to exit with SIGTERM
-      if ( auto opt_pid = m_subprocess->get_pid() )
-      {
-        kill(*opt_pid, SIGTERM);
-      } // if
+      m_subprocess->kill(SIGTERM);
       // Wait for process to exit
       auto ret = m_subprocess->wait();
       dreturn_if(not ret, "Mount '{}' exited unexpectedly"_fmt(m_path_dir_mountpoint));
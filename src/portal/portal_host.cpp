@@ -3,9 +3,18 @@
 // @file        : portal_host
 ///
 
+#include <charconv>
+#include <chrono>
 #include <fcntl.h>
+#include <map>
+#include <optional>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/wait.h>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <csignal>
@@ -14,7 +23,6 @@
 
 #include "../cpp/lib/log.hpp"
 #include "../cpp/lib/ipc.hpp"
-#include "../cpp/lib/fifo.hpp"
 #include "../cpp/lib/db.hpp"
 #include "../cpp/lib/env.hpp"
 #include "../cpp/macro.hpp"
@@ -23,13 +31,16 @@ namespace fs = std::filesystem;
 
 extern char** environ;
 
-std::atomic_bool G_CONTINUE = true;
-
-// signal_handler() {{{
-void signal_handler(int)
+// struct Metrics {{{
+struct Metrics
 {
-  G_CONTINUE = false;
-} // signal_handler() }}}
+  uint64_t count_served;
+  uint64_t count_failed;
+  // Time spent from a validated request to the execve of its child
+  uint64_t count_spawn;
+  uint64_t us_spawn_total;
+  uint64_t us_spawn_max;
+}; // struct Metrics }}}
 
 // search_path() {{{
 std::optional<fs::path> search_path(fs::path query)
@@ -61,117 +72,159 @@ std::optional<fs::path> search_path(fs::path query)
   return std::nullopt;
 } // search_path() }}}
 
-// fork_execve() {{{
-// Fork & execve child
-void fork_execve(std::string msg)
+// class PathCache {{{
+// Commands resolved through search_path, the table is dropped whenever PATH changes
+class PathCache
 {
-  auto db = ns_db::Db(msg);
-
-  // Get command
-  std::vector<std::string> vec_argv = db["command"].as_vector();
+  private:
+    std::string m_path;
+    std::unordered_map<std::string, fs::path> m_map;
+  public:
+    std::optional<fs::path> resolve(fs::path const& query);
+    void evict(fs::path const& query);
+}; // class PathCache }}}
+
+// PathCache::resolve() {{{
+inline std::optional<fs::path> PathCache::resolve(fs::path const& query)
+{
+  // Absolute paths do not depend on PATH
+  qreturn_if(query.is_absolute(), search_path(query));
+  // Invalidate on PATH change
+  if ( std::string path = ns_env::get_or_else("PATH", ""); path != m_path )
+  {
+    m_map.clear();
+    m_path = path;
+  } // if
+  auto it = m_map.find(query.string());
+  qreturn_if(it != m_map.end(), it->second);
+  auto opt_path_file_command = search_path(query);
+  if ( opt_path_file_command ) { m_map.emplace(query.string(), *opt_path_file_command); }
+  return opt_path_file_command;
+} // PathCache::resolve() }}}
+
+// PathCache::evict() {{{
+inline void PathCache::evict(fs::path const& query)
+{
+  m_map.erase(query.string());
+} // PathCache::evict() }}}
 
-  // Ignore on empty command
-  if ( vec_argv.empty() ) { return; }
+// struct Spawn {{{
+// Everything the child needs is prepared by the daemon before clone, the child shares the memory
+// of the daemon until execve, so it only performs system calls and reports failures through 'error'
+struct Spawn
+{
+  char const* path_file_command;
+  char* const* argv;
+  char* const* envp;
+  int const* fds;
+  pid_t ppid;
+  int error;
+}; // struct Spawn }}}
+
+// spawn_child() {{{
+int spawn_child(void* arg)
+{
+  auto spawn = static_cast<Spawn*>(arg);
+  auto f_fail = [&](int error) { spawn->error = error; _exit(127); };
 
-  // Create child
-  pid_t ppid = getpid();
-  pid_t pid = fork();
+  // Restore the signal mask blocked for the signalfd of the daemon
+  sigset_t mask;
+  sigemptyset(&mask);
+  if ( sigprocmask(SIG_SETMASK, &mask, nullptr) < 0 ) { f_fail(errno); }
 
-  // Failed to fork
-  ereturn_if(pid < 0, "Failed to fork");
+  // Die with daemon
+  if ( prctl(PR_SET_PDEATHSIG, SIGKILL) < 0 ) { f_fail(errno); }
+  if ( getppid() != spawn->ppid ) { f_fail(ESRCH); }
 
-  // Is parent
-  if (pid > 0)
+  // Redirect stdin, stdout and stderr to the ones of the guest, dup2 clears close-on-exec
+  for (int fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})
   {
-    // Write pid to fifo
-    auto expected_bytes_pid = ns_fifo::open_and_write(db["pid"].as_string().c_str(), std::span(&pid, sizeof(pid)));
-    elog_if(not expected_bytes_pid, expected_bytes_pid.error());
-    elog_if(*expected_bytes_pid != sizeof(pid), "Could not write pid");
-    // Wait for child to finish
-    int status;
-    ereturn_if(waitpid(pid, &status, 0) < 0, "waitpid failed");
-    // Get exit code
-    int code = (not WIFEXITED(status))? 1 : WEXITSTATUS(status);
-    ns_log::debug()("Exit code: {}", code);
-    // Send exit code of child through a fifo
-    auto expected_bytes_code = ns_fifo::open_and_write(std::string(db["exit"]), std::span(&code, sizeof(code)));
-    ereturn_if(not expected_bytes_code, expected_bytes_code.error());
-    ereturn_if(*expected_bytes_code != sizeof(code), "Could not write exit code");
-    return;
-  } // if
+    if ( dup2(spawn->fds[fd], fd) < 0 ) { f_fail(errno); }
+  } // for
 
-  // Die with daemon
-  eabort_if(prctl(PR_SET_PDEATHSIG, SIGKILL) < 0, strerror(errno));
-  eabort_if(::kill(ppid, 0) < 0, "Parent died, prctl will not have effect: {}"_fmt(strerror(errno)));
-  ns_log::debug()("{} dies with {}", getpid(), ppid);
+  execve(spawn->path_file_command, spawn->argv, spawn->envp);
 
-  // Open stdout/stderr FIFOs
-  int fd_stdout = open(db["stdout"].as_string().c_str(), O_WRONLY);
-  int fd_stderr = open(db["stderr"].as_string().c_str(), O_WRONLY);
-  eabort_if(fd_stdout < 0 or fd_stderr < 0, strerror(errno));
+  // Child should stop here
+  f_fail(errno);
+  return 127;
+} // spawn_child() }}}
+
+// spawn() {{{
+// Spawns the child with clone(CLONE_VM|CLONE_VFORK), which skips copying the page tables of the
+// daemon, its standard streams are the ones the guest sent through the connection
+std::optional<pid_t> spawn(ns_ipc::Ipc& connection
+  , ns_db::Db const& db
+  , std::vector<int> const& fds
+  , PathCache& path_cache)
+{
+  // The daemon is suspended until the child calls execve or exits, a single stack suffices
+  alignas(16) static char stack_child[1 << 16];
 
-  // Redirect stdout and stderr
-  eabort_if(dup2(fd_stdout, STDOUT_FILENO) < 0, strerror(errno));
-  eabort_if(dup2(fd_stderr, STDERR_FILENO) < 0, strerror(errno));
+  // Get command
+  std::vector<std::string> vec_argv = db["command"].as_vector();
 
-  // Close the original file descriptors
-  close(fd_stdout);
-  close(fd_stderr);
+  // Ignore on empty command
+  ereturn_if(vec_argv.empty(), "Empty command", std::nullopt);
 
-  // Search for command in PATH and replace vec_argv[0] with the full path to the binary
-  auto opt_path_file_command = search_path(vec_argv[0]);
-  eabort_if(not opt_path_file_command, "'{}' not found in PATH"_fmt(vec_argv[0]));
-  vec_argv[0] = opt_path_file_command->c_str();
-
-  // Create arguments for execve
-  auto argv_custom = std::make_unique<const char*[]>(vec_argv.size()+1);
-  // Set last arg to nullptr
-  argv_custom[vec_argv.size()] = nullptr;
-  // Copy entries
-  for(size_t i = 0; i < vec_argv.size(); ++i)
-  {
-    argv_custom[i] = vec_argv[i].c_str();
-  } // for
+  // Guest sends stdin, stdout and stderr
+  ereturn_if(fds.size() != 3, "Expected 3 file descriptors, got '{}'"_fmt(fds.size()), std::nullopt);
 
-  // Fetch environment from db
-  fs::path path_file_environment = db["environment"].as_string();
-  std::vector<std::string> vec_environment;
-  std::ifstream file_environment(path_file_environment);
-  eabort_if(not file_environment.is_open(), "Could not open {}"_fmt(path_file_environment));
-  for (std::string entry; std::getline(file_environment, entry);)
+  // Search for command in PATH and replace vec_argv[0] with the full path to the binary
+  std::string query = vec_argv[0];
+  auto opt_path_file_command = path_cache.resolve(query);
+  ereturn_if(not opt_path_file_command, "'{}' not found in PATH"_fmt(query), std::nullopt);
+  vec_argv[0] = opt_path_file_command->string();
+
+  // Create null terminated arguments and environment for execve
+  std::vector<std::string> vec_environment = db["environment"].as_vector();
+  auto f_pointers = [](std::vector<std::string>& vec)
   {
-    vec_environment.push_back(entry);
-  } // for
-  file_environment.close();
-  // Create environment for execve
-  auto env_custom = std::make_unique<const char*[]>(vec_environment.size()+1);
-  // Set last arg to nullptr
-  env_custom[vec_environment.size()] = nullptr;
-  // Copy entries
-  for(size_t i = 0; i < vec_environment.size(); ++i)
-  {
-    env_custom[i] = vec_environment[i].c_str();
-  } // for
+    std::vector<char*> vec_ptr;
+    vec_ptr.reserve(vec.size() + 1);
+    std::ranges::transform(vec, std::back_inserter(vec_ptr), [](auto& e){ return e.data(); });
+    vec_ptr.push_back(nullptr);
+    return vec_ptr;
+  };
+  std::vector<char*> vec_ptr_argv = f_pointers(vec_argv);
+  std::vector<char*> vec_ptr_env = f_pointers(vec_environment);
 
-  // Perform execve
-  execve(argv_custom[0], (char**) argv_custom.get(), (char**) env_custom.get());
+  // Create child
+  Spawn args
+  {
+    .path_file_command = vec_argv[0].c_str(),
+    .argv = vec_ptr_argv.data(),
+    .envp = vec_ptr_env.data(),
+    .fds = fds.data(),
+    .ppid = getpid(),
+    .error = 0,
+  };
+  pid_t pid = clone(spawn_child, stack_child + sizeof(stack_child), CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+
+  // Failed to clone
+  ereturn_if(pid < 0, "Failed to clone: {}"_fmt(strerror(errno)), std::nullopt);
+
+  // Child failed before execve, it is reaped by the event loop
+  if ( args.error != 0 )
+  {
+    // The binary may have been removed since it was cached
+    if ( args.error == ENOENT ) { path_cache.evict(query); }
+    ns_log::error()("Failed to spawn '{}': {}", vec_argv[0], strerror(args.error));
+    return std::nullopt;
+  } // if
 
-  // Child should stop here
-  std::abort();
-} // fork_execve() }}}
+  // Send pid to guest, the child is reaped by the event loop
+  elog_if(not connection.send(R"({{"pid":"{}"}})"_fmt(pid)), "Could not send pid");
+  ns_log::debug()("{} dies with {}", pid, args.ppid);
+  return pid;
+} // spawn() }}}
 
 // validate() {{{
-decltype(auto) validate(std::string_view msg) noexcept
+decltype(auto) validate(ns_db::Db const& db) noexcept
 {
   try
   {
-    auto db = ns_db::Db(msg);
     return db["command"].is_array()
-      and db["stdout"].is_string()
-      and db["stderr"].is_string()
-      and db["exit"].is_string()
-      and db["pid"].is_string()
-      and db["environment"].is_string();
+      and db["environment"].is_array();
   } // try
   catch(...)
   {
@@ -179,6 +232,19 @@ decltype(auto) validate(std::string_view msg) noexcept
   } // catch
 } // validate() }}}
 
+// is_metrics() {{{
+decltype(auto) is_metrics(ns_db::Db const& db) noexcept
+{
+  try
+  {
+    return db.contains("metrics");
+  } // try
+  catch(...)
+  {
+    return false;
+  } // catch
+} // is_metrics() }}}
+
 // main() {{{
 int main(int argc, char** argv)
 {
@@ -187,28 +253,174 @@ int main(int argc, char** argv)
   ns_log::set_sink_file(path_file_log);
   ns_log::set_level((ns_env::exists("FIM_DEBUG", "1"))? ns_log::Level::DEBUG : ns_log::Level::ERROR);
 
-  signal(SIGTERM, signal_handler);
-  signal(SIGINT, signal_handler);
-
   // Check args
   ereturn_if(argc != 2, "Incorrect number of arguments", EXIT_FAILURE);
 
-  // Create ipc instance
-  auto ipc = ns_ipc::Ipc::host(argv[1]);
-
-  // Recover messages
-  while (G_CONTINUE)
+  // Receive signals through the event loop
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGCHLD);
+  ereturn_if(sigprocmask(SIG_BLOCK, &mask, nullptr) < 0, strerror(errno), EXIT_FAILURE);
+  int fd_signal = signalfd(-1, &mask, SFD_CLOEXEC);
+  ereturn_if(fd_signal < 0, strerror(errno), EXIT_FAILURE);
+
+  // Listening socket inherited from the boot process, which owns the socket file
+  int fd_listen = -1;
+  auto [ptr, ec] = std::from_chars(argv[1], argv[1] + strlen(argv[1]), fd_listen);
+  ereturn_if(ec != std::errc{} or fd_listen < 0, "Invalid socket descriptor '{}'"_fmt(argv[1]), EXIT_FAILURE);
+  auto ipc = ns_ipc::Ipc::adopt(fd_listen);
+
+  // Create event loop
+  int fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+  ereturn_if(fd_epoll < 0, strerror(errno), EXIT_FAILURE);
+  auto f_watch = [&](int op, int fd, uint32_t events)
   {
-    auto opt_msg = ipc.recv();
-
-    ibreak_if(opt_msg == std::nullopt, "Empty message");
-
-    ns_log::info()("Recovered message: {}", *opt_msg);
+    epoll_event event{ .events = events, .data = { .fd = fd } };
+    // A socket may already be removed from the loop if its guest went away
+    elog_if(epoll_ctl(fd_epoll, op, fd, &event) < 0 and errno != ENOENT, "epoll_ctl failed: {}"_fmt(strerror(errno)));
+  };
+  f_watch(EPOLL_CTL_ADD, ipc.fd(), EPOLLIN);
+  f_watch(EPOLL_CTL_ADD, fd_signal, EPOLLIN);
+
+  // Connections waiting for their request, by socket
+  std::map<int, ns_ipc::Ipc> map_pending;
+  // Connections with a running child, by pid of the child
+  std::map<pid_t, ns_ipc::Ipc> map_running;
+  Metrics metrics{};
+  PathCache path_cache;
+
+  // Stops watching and closes a connection
+  auto f_drop = [&](auto& map, auto it)
+  {
+    f_watch(EPOLL_CTL_DEL, it->second.fd(), 0);
+    map.erase(it);
+  };
 
-    econtinue_if(not validate(*opt_msg), "Failed to validate message");
+  // Handles the request of a connection
+  auto f_request = [&](auto it_pending)
+  {
+    auto opt_msg = it_pending->second.recv();
+    if ( not opt_msg )
+    {
+      f_drop(map_pending, it_pending);
+      return;
+    } // if
+    ns_log::info()("Recovered message: {}", opt_msg->data);
+    // Parse the request once for all the checks below
+    std::optional<ns_db::Db> opt_db;
+    ns_exception::ignore([&]{ opt_db.emplace(std::string_view{opt_msg->data}); });
+    // Report metrics
+    if ( opt_db and is_metrics(*opt_db) )
+    {
+      elog_if(not it_pending->second.send(
+        R"({{"in_flight":"{}","served":"{}","failed":"{}","spawn_avg_us":"{}","spawn_max_us":"{}"}})"_fmt(
+            map_running.size()
+          , metrics.count_served
+          , metrics.count_failed
+          , (metrics.count_spawn == 0)? 0 : metrics.us_spawn_total / metrics.count_spawn
+          , metrics.us_spawn_max
+      )), "Could not send metrics");
+    } // if
+    // Spawn child
+    else if ( opt_db and validate(*opt_db) )
+    {
+      auto time_beg = std::chrono::steady_clock::now();
+      auto opt_pid = spawn(it_pending->second, *opt_db, opt_msg->fds, path_cache);
+      uint64_t us_spawn = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - time_beg).count();
+      metrics.count_spawn += 1;
+      metrics.us_spawn_total += us_spawn;
+      metrics.us_spawn_max = std::max(metrics.us_spawn_max, us_spawn);
+      if ( opt_pid )
+      {
+        // Watch for the guest going away while the child runs
+        f_watch(EPOLL_CTL_MOD, it_pending->first, EPOLLRDHUP);
+        map_running.emplace(*opt_pid, std::move(it_pending->second));
+        map_pending.erase(it_pending);
+        it_pending = map_pending.end();
+      } // if
+      else
+      {
+        metrics.count_failed += 1;
+      } // else
+    } // else if
+    else
+    {
+      ns_log::error()("Failed to validate message");
+      metrics.count_failed += 1;
+    } // else
+    // Close the guest streams in the daemon
+    std::ranges::for_each(opt_msg->fds, [](int fd){ close(fd); });
+    // Connection is done unless a child is running
+    if ( it_pending != map_pending.end() ) { f_drop(map_pending, it_pending); }
+  };
+
+  // Reaps finished children and sends their exit code
+  auto f_reap = [&]
+  {
+    int status;
+    for (pid_t pid; (pid = waitpid(-1, &status, WNOHANG)) > 0;)
+    {
+      auto it = map_running.find(pid);
+      qcontinue_if(it == map_running.end());
+      int code = (not WIFEXITED(status))? 1 : WEXITSTATUS(status);
+      ns_log::debug()("Exit code of '{}': {}", pid, code);
+      elog_if(not it->second.send(R"({{"exit":"{}"}})"_fmt(code)), "Could not send exit code");
+      metrics.count_served += 1;
+      f_drop(map_running, it);
+    } // for
+  };
+
+  // Serve requests
+  for (bool is_running = true; is_running;)
+  {
+    epoll_event events[64];
+    int count_events = epoll_wait(fd_epoll, events, std::size(events), -1);
+    qcontinue_if(count_events < 0 and errno == EINTR);
+    ebreak_if(count_events < 0, "epoll_wait failed: {}"_fmt(strerror(errno)));
+    for (int i = 0; i < count_events; ++i)
+    {
+      int fd = events[i].data.fd;
+      // Novel connection
+      if ( fd == ipc.fd() )
+      {
+        auto opt_connection = ipc.accept();
+        qcontinue_if(not opt_connection);
+        // Do not let a stalled guest block the loop while its request is read
+        timeval timeout{ .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(opt_connection->fd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        f_watch(EPOLL_CTL_ADD, opt_connection->fd(), EPOLLIN | EPOLLRDHUP);
+        map_pending.emplace(opt_connection->fd(), std::move(*opt_connection));
+      } // if
+      // Signals
+      else if ( fd == fd_signal )
+      {
+        signalfd_siginfo info;
+        qcontinue_if(read(fd_signal, &info, sizeof(info)) != sizeof(info));
+        if ( info.ssi_signo == SIGCHLD ) { f_reap(); }
+        else { is_running = false; }
+      } // else if
+      // Request from a connection
+      else if ( auto it_pending = map_pending.find(fd); it_pending != map_pending.end() )
+      {
+        f_request(it_pending);
+      } // else if
+      // Guest went away while its child runs
+      else if ( auto it_running = std::ranges::find_if(map_running, [&](auto&& e){ return e.second.fd() == fd; });
+        it_running != map_running.end() )
+      {
+        ns_log::debug()("Guest of '{}' disconnected", it_running->first);
+        ::kill(it_running->first, SIGTERM);
+        f_watch(EPOLL_CTL_DEL, fd, 0);
+      } // else if
+    } // for
+  } // for
 
-    fork_execve(*opt_msg);
-  } // while
+  // Stop children that are still running
+  std::ranges::for_each(map_running, [](auto&& e){ ::kill(e.first, SIGTERM); });
+  close(fd_epoll);
+  close(fd_signal);
 
   return EXIT_SUCCESS;
 } // main() }}}